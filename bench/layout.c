@@ -0,0 +1,259 @@
+/*
+ * XWiimote - layout benchmark
+ *
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Replays synthetic IR and accelerometer reports over many devices through
+ * the real driver and reports the time per report and how many cache lines
+ * of struct xwiimote_dev the IR path touches. The driver source is included
+ * as is and built against the stubs in bench/stub.c, so every device goes
+ * through PreInit, DEVICE_INIT and DEVICE_ON like in the server.
+ *
+ * Usage: xwiimote-layout [devices] [rounds] [evict-kb]
+ * Between rounds evict-kb of unrelated memory is read, like the rest of the
+ * server would between two reports of the same remote.
+ *
+ * To compare with another revision of the driver, build the benchmark
+ * against its source:
+ *   git show <rev>:src/xwiimote.c > old.c
+ *   touch bench/layout.c
+ *   make bench/xwiimote-layout XWIIMOTE_SRC=$PWD/old.c
+ */
+
+#ifndef XWIIMOTE_SRC
+#define XWIIMOTE_SRC "src/xwiimote.c"
+#endif
+#include XWIIMOTE_SRC
+
+#include <time.h>
+#include "stub.h"
+
+static volatile uintptr_t sink;
+
+/* fields the IR path reads or writes for every report */
+#define IR_FIELDS(X) \
+	X(info) X(dup) X(rec_on) X(raw_used) X(raw_changed) X(motion) \
+	X(motion_source) X(idle_timeout_secs) X(precision_held) \
+	X(scroll_held) X(motion_frame_ms) X(click_lock_until) \
+	X(motion_history_cur) X(motion_history) X(ir_last_valid_event) \
+	X(ir_vec_x) X(ir_vec_y) X(ir_ref_x) X(ir_ref_y) X(ir_avg_x) \
+	X(ir_avg_y) X(ir_avg_time) X(ir_rate) X(ir_avg_radius) \
+	X(ir_avg_max_ms) X(ir_avg_min_ms) X(ir_avg_weight)
+
+static unsigned int count_lines(const size_t *offs, unsigned int num)
+{
+	unsigned int i, j, lines = 0;
+
+	for (i = 0; i < num; ++i) {
+		for (j = 0; j < i; ++j) {
+			if (offs[j] / XWIIMOTE_CACHE_LINE ==
+			    offs[i] / XWIIMOTE_CACHE_LINE)
+				break;
+		}
+		if (j == i)
+			++lines;
+	}
+
+	return lines;
+}
+
+static void make_reports(struct xwii_event *ir, struct xwii_event *accel,
+			 unsigned int round, unsigned int dev)
+{
+	unsigned int i, j = (round * 7 + dev * 13) % 32;
+
+	memset(ir, 0, sizeof(*ir));
+	ir->type = XWII_EVENT_IR;
+	ir->time.tv_sec = round / 100;
+	ir->time.tv_usec = round % 100 * 10000;
+	for (i = 0; i < 4; ++i) {
+		ir->v.abs[i].x = 1023;
+		ir->v.abs[i].y = 1023;
+	}
+	ir->v.abs[0].x = 400 + j;
+	ir->v.abs[0].y = 380 + j / 2;
+	ir->v.abs[1].x = 600 + j;
+	ir->v.abs[1].y = 384 + j / 2;
+
+	memset(accel, 0, sizeof(*accel));
+	accel->type = XWII_EVENT_ACCEL;
+	accel->time = ir->time;
+	accel->v.abs[0].x = 100 - j;
+	accel->v.abs[0].y = 20 + j;
+	accel->v.abs[0].z = 50;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void evict(const uint8_t *buf, size_t size)
+{
+	uintptr_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < size; i += XWIIMOTE_CACHE_LINE)
+		sum += buf[i];
+	sink += sum;
+}
+
+static const char *options[] = {
+	"Device", "/dev/null",
+	"MotionSource", "ir",
+	NULL
+};
+
+struct bench_dev {
+	InputInfoRec info;
+	DeviceIntRec device;
+};
+
+static void bench_free(struct bench_dev *b)
+{
+	if (b->device.public.on)
+		b->info.device_control(&b->device, DEVICE_OFF);
+	if (b->info.dev)
+		b->info.device_control(&b->device, DEVICE_CLOSE);
+	xwiimote_driver.UnInit(&xwiimote_driver, &b->info, 0);
+}
+
+static int bench_init(struct bench_dev *b)
+{
+	memset(b, 0, sizeof(*b));
+	b->info.name = (char*)XWII_NAME_CORE;
+	b->info.options = options;
+
+	if (xwiimote_driver.PreInit(&xwiimote_driver, &b->info, 0) != Success)
+		return -1;
+
+	b->device.public.devicePrivate = &b->info;
+	b->info.dev = &b->device;
+	if (b->info.device_control(&b->device, DEVICE_INIT) != Success ||
+	    b->info.device_control(&b->device, DEVICE_ON) != Success) {
+		bench_free(b);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns the mean time per report in ns or a negative value on failure. */
+static double run(unsigned int num, unsigned int rounds, const uint8_t *buf,
+		  size_t size)
+{
+	struct bench_dev *devs;
+	struct xwiimote_dev *dev;
+	struct xwii_event ir, accel;
+	unsigned int r, i, n;
+	double ns = 0, start;
+
+	devs = calloc(num, sizeof(*devs));
+	if (!devs)
+		return -1;
+
+	for (n = 0; n < num; ++n) {
+		if (bench_init(&devs[n])) {
+			ns = -1;
+			goto out;
+		}
+	}
+
+	for (r = 0; r < rounds; ++r) {
+		evict(buf, size);
+		start = now_ns();
+		for (i = 0; i < num; ++i) {
+			dev = devs[i].info.private;
+			make_reports(&ir, &accel, r, i);
+			stub_queue(dev->iface, &ir);
+			stub_queue(dev->iface, &accel);
+			xwiimote_input(devs[i].info.fd, dev);
+		}
+		ns += now_ns() - start;
+	}
+	ns /= (double)rounds * num * 2;
+
+out:
+	while (n--)
+		bench_free(&devs[n]);
+	free(devs);
+	return ns;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int num = 32, rounds = 20000, pass, n = 0;
+	size_t size = 1024 * 1024, i;
+	size_t offs[64];
+	double best = 0, t;
+	uint8_t *buf;
+
+	if (argc > 1)
+		num = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		rounds = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		size = strtoul(argv[3], NULL, 10) * 1024;
+	if (!num || num > MAXDEVICES || !rounds) {
+		fprintf(stderr, "usage: %s [devices] [rounds] [evict-kb]\n",
+			argv[0]);
+		fprintf(stderr, "at most %u devices\n", MAXDEVICES);
+		return 1;
+	}
+
+	buf = malloc(size + 1);
+	if (!buf)
+		return 1;
+	for (i = 0; i <= size; ++i)
+		buf[i] = i;
+
+#define OFFS(f) offs[n++] = offsetof(struct xwiimote_dev, f);
+	IR_FIELDS(OFFS)
+#undef OFFS
+
+	printf("struct size: %zu bytes\n", sizeof(struct xwiimote_dev));
+	printf("cache lines per IR report: %u\n", count_lines(offs, n));
+
+	for (pass = 0; pass < 3; ++pass) {
+		t = run(num, rounds, buf, size);
+		if (t < 0) {
+			fprintf(stderr, "cannot set up the devices\n");
+			free(buf);
+			return 1;
+		}
+		if (!pass || t < best)
+			best = t;
+	}
+
+	printf("%u devices, %u rounds, %zu KiB evicted per round\n",
+	       num, rounds, size / 1024);
+	printf("ns per report: %.1f\n", best);
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,588 @@
+/*
+ * XWiimote - layout benchmark
+ *
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Stubs for the X server, udev and libxwiimote, so the driver can run outside
+ * the server. Events posted by the driver are dropped, timers never fire and
+ * udev describes one made-up Wii Remote per lookup.
+ */
+
+#include <errno.h>
+#include <libudev.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <xorg-server.h>
+#include <xwiimote.h>
+#include "stub.h"
+
+#define STUB_QUEUE_NUM 8
+
+ClientPtr serverClient;
+unsigned long serverGeneration = 1;
+
+static const char *stub_option(void *options, const char *name)
+{
+	const char **opt;
+
+	for (opt = options; opt && opt[0]; opt += 2) {
+		if (!strcasecmp(opt[0], name))
+			return opt[1];
+	}
+
+	return NULL;
+}
+
+void xf86IDrvMsg(InputInfoPtr info, int type, const char *format, ...)
+{
+	va_list args;
+
+	if (type != X_ERROR)
+		return;
+
+	va_start(args, format);
+	fprintf(stderr, "%s: ", info->name);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+const char *xf86FindOptionValue(void *options, const char *name)
+{
+	return stub_option(options, name);
+}
+
+char *xf86SetStrOption(void *options, const char *name, const char *def)
+{
+	const char *val = stub_option(options, name);
+
+	if (!val)
+		val = def;
+	return val ? strdup(val) : NULL;
+}
+
+int xf86SetBoolOption(void *options, const char *name, int def)
+{
+	const char *val = stub_option(options, name);
+
+	if (!val)
+		return def;
+	return !strcasecmp(val, "on") || !strcasecmp(val, "true") ||
+	       !strcasecmp(val, "yes") || !strcmp(val, "1");
+}
+
+double xf86SetRealOption(void *options, const char *name, double def)
+{
+	const char *val = stub_option(options, name);
+
+	return val ? strtod(val, NULL) : def;
+}
+
+void xf86AddInputDriver(InputDriverPtr driver, pointer module, int flags)
+{
+}
+
+void xf86DeleteInput(InputInfoPtr info, int flags)
+{
+}
+
+void *xf86AddInputHandler(int fd, void (*proc)(int fd, pointer data),
+			  pointer data)
+{
+	return data;
+}
+
+int xf86RemoveInputHandler(void *handler)
+{
+	return 0;
+}
+
+void xf86PostMotionEvent(DeviceIntPtr device, int is_absolute,
+			 int first_valuator, int num_valuators, ...)
+{
+}
+
+void xf86PostMotionEventM(DeviceIntPtr device, int is_absolute,
+			  const ValuatorMask *mask)
+{
+}
+
+void xf86PostButtonEvent(DeviceIntPtr device, int is_absolute, int button,
+			 int is_down, int first_valuator, int num_valuators,
+			 ...)
+{
+}
+
+void xf86PostKeyboardEvent(DeviceIntPtr device, unsigned int key_code,
+			   int is_down)
+{
+}
+
+Bool xf86InitValuatorAxisStruct(DeviceIntPtr dev, int axnum, Atom label,
+				int minval, int maxval, int resolution,
+				int min_res, int max_res, int mode)
+{
+	return TRUE;
+}
+
+void xf86InitValuatorDefaults(DeviceIntPtr dev, int axnum)
+{
+}
+
+Bool InitValuatorClassDeviceStruct(DeviceIntPtr device, int num_axes,
+				   Atom *labels, int num_motion_events,
+				   int mode)
+{
+	return TRUE;
+}
+
+Bool InitButtonClassDeviceStruct(DeviceIntPtr device, int num_buttons,
+				 Atom *labels, CARD8 *map)
+{
+	return TRUE;
+}
+
+Bool InitKeyboardDeviceStruct(DeviceIntPtr device, XkbRMLVOSet *rmlvo,
+			      void *bell_func, void *ctrl_func)
+{
+	return TRUE;
+}
+
+Bool InitKeyboardDeviceStructFromString(DeviceIntPtr device,
+					const char *keymap, int keymap_length,
+					void *bell_func, void *ctrl_func)
+{
+	return TRUE;
+}
+
+Bool SetScrollValuator(DeviceIntPtr dev, int axnum, enum ScrollType type,
+		       double increment, int flags)
+{
+	return TRUE;
+}
+
+int GetMotionHistorySize(void)
+{
+	return 0;
+}
+
+void XkbFreeRMLVOSet(XkbRMLVOSet *rmlvo, Bool free_rmlvo)
+{
+	free(rmlvo->rules);
+	free(rmlvo->model);
+	free(rmlvo->layout);
+	free(rmlvo->variant);
+	free(rmlvo->options);
+	if (free_rmlvo)
+		free(rmlvo);
+}
+
+Bool XkbCopyDeviceKeymap(DeviceIntPtr dst, DeviceIntPtr src)
+{
+	return TRUE;
+}
+
+Atom MakeAtom(const char *string, unsigned int len, Bool make_it)
+{
+	static Atom next = XA_LAST_PREDEFINED;
+
+	return ++next;
+}
+
+Atom XIGetKnownProperty(const char *name)
+{
+	return MakeAtom(name, strlen(name), TRUE);
+}
+
+int XIChangeDeviceProperty(DeviceIntPtr dev, Atom property, Atom type,
+			   int format, int mode, unsigned long len,
+			   const void *value, Bool sendevent)
+{
+	return Success;
+}
+
+int XISetDevicePropertyDeletable(DeviceIntPtr dev, Atom property,
+				 Bool deletable)
+{
+	return Success;
+}
+
+long XIRegisterPropertyHandler(DeviceIntPtr dev,
+			       int (*set)(DeviceIntPtr dev, Atom property,
+					  XIPropertyValuePtr prop,
+					  BOOL checkonly),
+			       int (*get)(DeviceIntPtr dev, Atom property),
+			       int (*del)(DeviceIntPtr dev, Atom property))
+{
+	return 1;
+}
+
+ValuatorMask *valuator_mask_new(int num_valuators)
+{
+	return calloc(num_valuators, sizeof(double));
+}
+
+void valuator_mask_free(ValuatorMask **mask)
+{
+	free(*mask);
+	*mask = NULL;
+}
+
+void valuator_mask_zero(ValuatorMask *mask)
+{
+}
+
+void valuator_mask_set(ValuatorMask *mask, int valuator, int data)
+{
+}
+
+void valuator_mask_set_double(ValuatorMask *mask, int valuator, double data)
+{
+}
+
+/* timers are only allocated, there is no main loop to run them */
+struct _OsTimerRec {
+	OsTimerCallback func;
+	void *arg;
+};
+
+OsTimerPtr TimerSet(OsTimerPtr timer, int flags, CARD32 millis,
+		    OsTimerCallback func, void *arg)
+{
+	if (!timer)
+		timer = calloc(1, sizeof(*timer));
+	if (timer) {
+		timer->func = func;
+		timer->arg = arg;
+	}
+	return timer;
+}
+
+void TimerCancel(OsTimerPtr timer)
+{
+}
+
+void TimerFree(OsTimerPtr timer)
+{
+	free(timer);
+}
+
+CARD32 GetTimeInMillis(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void input_lock(void)
+{
+}
+
+void input_unlock(void)
+{
+}
+
+int AllocDevicePair(ClientPtr client, const char *name, DeviceIntPtr *ptr,
+		    DeviceIntPtr *keybd, DeviceProc ptr_proc,
+		    DeviceProc keybd_proc, Bool master)
+{
+	return BadAlloc;
+}
+
+int CorePointerProc(DeviceIntPtr device, int what)
+{
+	return Success;
+}
+
+int CoreKeyboardProc(DeviceIntPtr device, int what)
+{
+	return Success;
+}
+
+int ActivateDevice(DeviceIntPtr device, BOOL sendevent)
+{
+	return Success;
+}
+
+Bool EnableDevice(DeviceIntPtr device, BOOL sendevent)
+{
+	return TRUE;
+}
+
+int RemoveDevice(DeviceIntPtr dev, BOOL sendevent)
+{
+	return Success;
+}
+
+int AttachDevice(ClientPtr client, DeviceIntPtr slave, DeviceIntPtr master)
+{
+	return Success;
+}
+
+Bool IsMaster(DeviceIntPtr dev)
+{
+	return FALSE;
+}
+
+int dixLookupDevice(DeviceIntPtr *dev, int id, ClientPtr client,
+		    Mask access_mode)
+{
+	return BadMatch;
+}
+
+/*
+ * Every lookup by device number yields a new Wii Remote HID device, so each
+ * InputInfoRec becomes a core device of its own. The device is its own HID
+ * parent. Event nodes cannot be looked up.
+ */
+struct udev_device {
+	char syspath[64];
+};
+
+static struct udev *stub_udev = (struct udev *)&stub_udev;
+
+struct udev *udev_new(void)
+{
+	return stub_udev;
+}
+
+struct udev *udev_unref(struct udev *udev)
+{
+	return NULL;
+}
+
+struct udev_device *udev_device_new_from_devnum(struct udev *udev, char type,
+						dev_t devnum)
+{
+	static unsigned int num;
+	struct udev_device *dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (dev)
+		snprintf(dev->syspath, sizeof(dev->syspath),
+			 "/sys/devices/bench/0005:057E:0306.%04X", ++num);
+	return dev;
+}
+
+struct udev_device *udev_device_new_from_syspath(struct udev *udev,
+						 const char *syspath)
+{
+	return NULL;
+}
+
+struct udev_device *udev_device_unref(struct udev_device *dev)
+{
+	free(dev);
+	return NULL;
+}
+
+struct udev_device *udev_device_get_parent_with_subsystem_devtype(
+		struct udev_device *dev, const char *subsystem,
+		const char *devtype)
+{
+	return strcmp(subsystem, "hid") ? NULL : dev;
+}
+
+const char *udev_device_get_driver(struct udev_device *dev)
+{
+	return "wiimote";
+}
+
+const char *udev_device_get_subsystem(struct udev_device *dev)
+{
+	return "hid";
+}
+
+const char *udev_device_get_syspath(struct udev_device *dev)
+{
+	return dev->syspath;
+}
+
+const char *udev_device_get_sysname(struct udev_device *dev)
+{
+	return strrchr(dev->syspath, '/') + 1;
+}
+
+const char *udev_device_get_devnode(struct udev_device *dev)
+{
+	return NULL;
+}
+
+const char *udev_device_get_sysattr_value(struct udev_device *dev,
+					  const char *sysattr)
+{
+	return NULL;
+}
+
+const char *udev_device_get_property_value(struct udev_device *dev,
+					   const char *key)
+{
+	return NULL;
+}
+
+struct udev_enumerate *udev_enumerate_new(struct udev *udev)
+{
+	return NULL;
+}
+
+struct udev_enumerate *udev_enumerate_unref(struct udev_enumerate *e)
+{
+	return NULL;
+}
+
+int udev_enumerate_add_match_subsystem(struct udev_enumerate *e,
+				       const char *subsystem)
+{
+	return -ENOSYS;
+}
+
+int udev_enumerate_add_match_parent(struct udev_enumerate *e,
+				    struct udev_device *parent)
+{
+	return -ENOSYS;
+}
+
+int udev_enumerate_scan_devices(struct udev_enumerate *e)
+{
+	return -ENOSYS;
+}
+
+struct udev_list_entry *udev_enumerate_get_list_entry(struct udev_enumerate *e)
+{
+	return NULL;
+}
+
+struct udev_list_entry *udev_list_entry_get_next(struct udev_list_entry *entry)
+{
+	return NULL;
+}
+
+const char *udev_list_entry_get_name(struct udev_list_entry *entry)
+{
+	return NULL;
+}
+
+/*
+ * A remote with the core, accelerometer and IR interfaces and no extension.
+ * Reports come from stub_queue() instead of the kernel.
+ */
+struct xwii_iface {
+	int fd;
+	unsigned int opened;
+	struct xwii_event queue[STUB_QUEUE_NUM];
+	unsigned int head;
+	unsigned int num;
+};
+
+#define STUB_IFACES (XWII_IFACE_CORE | XWII_IFACE_ACCEL | XWII_IFACE_IR)
+
+int stub_queue(struct xwii_iface *iface, const struct xwii_event *ev)
+{
+	if (iface->num >= STUB_QUEUE_NUM)
+		return -ENOSPC;
+
+	iface->queue[(iface->head + iface->num++) % STUB_QUEUE_NUM] = *ev;
+	return 0;
+}
+
+int xwii_iface_new(struct xwii_iface **dev, const char *syspath)
+{
+	static int fd = 100;
+
+	*dev = calloc(1, sizeof(**dev));
+	if (!*dev)
+		return -ENOMEM;
+	(*dev)->fd = fd++;
+	return 0;
+}
+
+void xwii_iface_unref(struct xwii_iface *dev)
+{
+	free(dev);
+}
+
+int xwii_iface_get_fd(struct xwii_iface *dev)
+{
+	return dev->fd;
+}
+
+int xwii_iface_watch(struct xwii_iface *dev, bool watch)
+{
+	return 0;
+}
+
+int xwii_iface_open(struct xwii_iface *dev, unsigned int ifaces)
+{
+	dev->opened |= ifaces & STUB_IFACES;
+	return ifaces & ~STUB_IFACES ? -ENODEV : 0;
+}
+
+void xwii_iface_close(struct xwii_iface *dev, unsigned int ifaces)
+{
+	dev->opened &= ~ifaces;
+}
+
+unsigned int xwii_iface_opened(struct xwii_iface *dev)
+{
+	return dev->opened;
+}
+
+unsigned int xwii_iface_available(struct xwii_iface *dev)
+{
+	return STUB_IFACES;
+}
+
+int xwii_iface_dispatch(struct xwii_iface *dev, struct xwii_event *ev,
+			size_t size)
+{
+	if (!dev->num)
+		return -EAGAIN;
+
+	memcpy(ev, &dev->queue[dev->head], size < sizeof(*ev) ?
+					      size : sizeof(*ev));
+	dev->head = (dev->head + 1) % STUB_QUEUE_NUM;
+	--dev->num;
+	return 0;
+}
+
+int xwii_iface_get_extension(struct xwii_iface *dev, char **extension)
+{
+	*extension = strdup("none");
+	return *extension ? 0 : -ENOMEM;
+}
+
+void xwii_iface_set_mp_normalization(struct xwii_iface *dev, int32_t x,
+				     int32_t y, int32_t z, int32_t factor)
+{
+}
+
+void xwii_iface_get_mp_normalization(struct xwii_iface *dev, int32_t *x,
+				     int32_t *y, int32_t *z, int32_t *factor)
+{
+	*x = *y = *z = *factor = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * XWiimote - layout benchmark
+ *
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Hooks of the stubbed server, udev and libxwiimote in bench/stub.c that the
+ * benchmark uses to drive the driver.
+ */
+
+#ifndef XWIIMOTE_STUB_H
+#define XWIIMOTE_STUB_H
+
+#include <xwiimote.h>
+
+/*
+ * The options of a device are passed as InputInfoRec.options, which points
+ * to a NULL-terminated array of name and value strings.
+ */
+
+/* Queue @ev to be returned by the next xwii_iface_dispatch() on @iface. */
+int stub_queue(struct xwii_iface *iface, const struct xwii_event *ev);
+
+#endif /* XWIIMOTE_STUB_H */
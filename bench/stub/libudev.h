@@ -0,0 +1,77 @@
+/*
+ * XWiimote - layout benchmark
+ *
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The parts of libudev the driver uses. The benchmark does not run on a real
+ * device, so bench/stub.c answers the lookups with a made-up Wii Remote.
+ */
+
+#ifndef XWIIMOTE_STUB_LIBUDEV_H
+#define XWIIMOTE_STUB_LIBUDEV_H
+
+#include <sys/types.h>
+
+struct udev;
+struct udev_device;
+struct udev_enumerate;
+struct udev_list_entry;
+
+struct udev *udev_new(void);
+struct udev *udev_unref(struct udev *udev);
+
+struct udev_device *udev_device_new_from_devnum(struct udev *udev, char type,
+						dev_t devnum);
+struct udev_device *udev_device_new_from_syspath(struct udev *udev,
+						 const char *syspath);
+struct udev_device *udev_device_unref(struct udev_device *dev);
+struct udev_device *udev_device_get_parent_with_subsystem_devtype(
+		struct udev_device *dev, const char *subsystem,
+		const char *devtype);
+const char *udev_device_get_driver(struct udev_device *dev);
+const char *udev_device_get_subsystem(struct udev_device *dev);
+const char *udev_device_get_syspath(struct udev_device *dev);
+const char *udev_device_get_sysname(struct udev_device *dev);
+const char *udev_device_get_devnode(struct udev_device *dev);
+const char *udev_device_get_sysattr_value(struct udev_device *dev,
+					  const char *sysattr);
+const char *udev_device_get_property_value(struct udev_device *dev,
+					   const char *key);
+
+struct udev_enumerate *udev_enumerate_new(struct udev *udev);
+struct udev_enumerate *udev_enumerate_unref(struct udev_enumerate *e);
+int udev_enumerate_add_match_subsystem(struct udev_enumerate *e,
+				       const char *subsystem);
+int udev_enumerate_add_match_parent(struct udev_enumerate *e,
+				    struct udev_device *parent);
+int udev_enumerate_scan_devices(struct udev_enumerate *e);
+struct udev_list_entry *udev_enumerate_get_list_entry(struct udev_enumerate *e);
+struct udev_list_entry *udev_list_entry_get_next(struct udev_list_entry *entry);
+const char *udev_list_entry_get_name(struct udev_list_entry *entry);
+
+#define udev_list_entry_foreach(entry, first) \
+	for (entry = first; entry; entry = udev_list_entry_get_next(entry))
+
+#endif /* XWIIMOTE_STUB_LIBUDEV_H */
@@ -0,0 +1,2 @@
+/* see xorg-server.h */
+#include "xorg-server.h"
@@ -0,0 +1,295 @@
+/*
+ * XWiimote - layout benchmark
+ *
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The parts of the X server API the driver uses, declared just far enough to
+ * build src/xwiimote.c without the server. The functions are defined in
+ * bench/stub.c. The other server headers the driver includes only include
+ * this one.
+ */
+
+#ifndef XWIIMOTE_STUB_XORG_SERVER_H
+#define XWIIMOTE_STUB_XORG_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <X11/Xatom.h>
+
+typedef int Bool;
+typedef int BOOL;
+typedef void *pointer;
+typedef uint32_t Atom;
+typedef uint8_t CARD8;
+typedef uint16_t CARD16;
+typedef uint32_t CARD32;
+typedef int32_t INT32;
+typedef unsigned long Mask;
+
+#define TRUE 1
+#define FALSE 0
+
+#define Success 0
+#define BadValue 2
+#define BadMatch 8
+#define BadAccess 10
+#define BadAlloc 11
+#define BadImplementation 17
+
+#define X_PROBED 1
+#define X_CONFIG 2
+#define X_ERROR 5
+#define X_WARNING 6
+#define X_INFO 7
+
+#define _X_EXPORT
+#define _X_INLINE inline
+
+#define MAXDEVICES 40
+#define PropModeReplace 0
+#define DixUnknownAccess 0
+#define XI_MOUSE "MOUSE"
+#define XI_KEYBOARD "KEYBOARD"
+#define Absolute 1
+#define Relative 0
+
+#define ABI_XINPUT_VERSION (24 << 16)
+#define GET_ABI_MAJOR(x) ((x) >> 16)
+#define ABI_CLASS_XINPUT "X.Org XInput driver"
+#define MOD_CLASS_XINPUT "X.Org XInput Driver"
+#define MODULEVENDORSTRING "X.Org Foundation"
+#define MODINFOSTRING1 0xef23fdc5
+#define MODINFOSTRING2 0x10dc023a
+#define XORG_VERSION_CURRENT 0
+
+#define DEVICE_INIT 0
+#define DEVICE_ON 1
+#define DEVICE_OFF 2
+#define DEVICE_CLOSE 3
+#define DEVICE_ABORT 4
+
+#define MASTER_POINTER 1
+#define MASTER_KEYBOARD 2
+#define SLAVE 3
+#define MASTER_ATTACHED 4
+
+#define SCROLL_FLAG_NONE 0
+#define SCROLL_FLAG_PREFERRED 2
+
+#define BTN_LABEL_PROP_BTN_UNKNOWN "Button Unknown"
+#define BTN_LABEL_PROP_BTN_LEFT "Button Left"
+#define BTN_LABEL_PROP_BTN_RIGHT "Button Right"
+#define BTN_LABEL_PROP_BTN_MIDDLE "Button Middle"
+#define BTN_LABEL_PROP_BTN_WHEEL_UP "Button Wheel Up"
+#define BTN_LABEL_PROP_BTN_WHEEL_DOWN "Button Wheel Down"
+#define BTN_LABEL_PROP_BTN_HWHEEL_LEFT "Button Horiz Wheel Left"
+#define BTN_LABEL_PROP_BTN_HWHEEL_RIGHT "Button Horiz Wheel Right"
+#define AXIS_LABEL_PROP_ABS_X "Abs X"
+#define AXIS_LABEL_PROP_ABS_Y "Abs Y"
+#define AXIS_LABEL_PROP_ABS_Z "Abs Z"
+#define AXIS_LABEL_PROP_ABS_RX "Abs Rotary X"
+#define AXIS_LABEL_PROP_ABS_RY "Abs Rotary Y"
+#define AXIS_LABEL_PROP_ABS_RZ "Abs Rotary Z"
+#define AXIS_LABEL_PROP_ABS_MISC "Abs Misc"
+#define AXIS_LABEL_PROP_REL_X "Rel X"
+#define AXIS_LABEL_PROP_REL_Y "Rel Y"
+#define AXIS_LABEL_PROP_REL_HWHEEL "Rel Horiz Wheel"
+#define AXIS_LABEL_PROP_REL_WHEEL "Rel Vert Wheel"
+
+enum ScrollType {
+	SCROLL_TYPE_NONE = 0,
+	SCROLL_TYPE_VERTICAL = 8,
+	SCROLL_TYPE_HORIZONTAL = 9,
+};
+
+typedef struct _Client *ClientPtr;
+typedef struct _ValuatorMask ValuatorMask;
+typedef struct _OsTimerRec *OsTimerPtr;
+typedef CARD32 (*OsTimerCallback)(OsTimerPtr timer, CARD32 time, void *arg);
+
+typedef struct _DeviceIntRec *DeviceIntPtr;
+typedef struct _InputInfoRec *InputInfoPtr;
+typedef struct _InputDriverRec *InputDriverPtr;
+typedef int (*DeviceProc)(DeviceIntPtr device, int what);
+
+typedef struct {
+	void *devicePrivate;
+	Bool on;
+} DevicePublic;
+
+typedef struct _DeviceIntRec {
+	DevicePublic public;
+	int id;
+	char *name;
+	void *key;
+} DeviceIntRec;
+
+typedef struct _InputInfoRec {
+	char *name;
+	char *type_name;
+	void *options;
+	void *private;
+	int fd;
+	DeviceIntPtr dev;
+	int (*device_control)(DeviceIntPtr device, int what);
+	void (*read_input)(InputInfoPtr info);
+	int (*switch_mode)(ClientPtr client, DeviceIntPtr dev, int mode);
+} InputInfoRec;
+
+typedef struct _InputDriverRec {
+	int driverVersion;
+	const char *driverName;
+	void (*Identify)(int flags);
+	int (*PreInit)(InputDriverPtr drv, InputInfoPtr info, int flags);
+	void (*UnInit)(InputDriverPtr drv, InputInfoPtr info, int flags);
+	void *module;
+	const char **default_options;
+} InputDriverRec;
+
+typedef struct {
+	const char *modname;
+	const char *vendor;
+	CARD32 _modinfo1_;
+	CARD32 _modinfo2_;
+	CARD32 xf86version;
+	CARD8 majorversion;
+	CARD8 minorversion;
+	CARD16 patchlevel;
+	const char *abiclass;
+	CARD32 abiversion;
+	const char *moduleclass;
+	CARD32 checksum[4];
+} XF86ModuleVersionInfo;
+
+typedef struct {
+	XF86ModuleVersionInfo *vers;
+	pointer (*setup)(pointer module, pointer opts, int *errmaj,
+			 int *errmin);
+	void (*teardown)(pointer module);
+} XF86ModuleData;
+
+typedef struct _XIPropertyValue {
+	Atom type;
+	short format;
+	long size;
+	void *data;
+} XIPropertyValueRec, *XIPropertyValuePtr;
+
+typedef struct {
+	char *rules;
+	char *model;
+	char *layout;
+	char *variant;
+	char *options;
+} XkbRMLVOSet;
+
+extern ClientPtr serverClient;
+extern unsigned long serverGeneration;
+
+void xf86IDrvMsg(InputInfoPtr info, int type, const char *format, ...);
+const char *xf86FindOptionValue(void *options, const char *name);
+char *xf86SetStrOption(void *options, const char *name, const char *def);
+int xf86SetBoolOption(void *options, const char *name, int def);
+double xf86SetRealOption(void *options, const char *name, double def);
+void xf86AddInputDriver(InputDriverPtr driver, pointer module, int flags);
+void xf86DeleteInput(InputInfoPtr info, int flags);
+void *xf86AddInputHandler(int fd, void (*proc)(int fd, pointer data),
+			  pointer data);
+int xf86RemoveInputHandler(void *handler);
+void xf86PostMotionEvent(DeviceIntPtr device, int is_absolute,
+			 int first_valuator, int num_valuators, ...);
+void xf86PostMotionEventM(DeviceIntPtr device, int is_absolute,
+			  const ValuatorMask *mask);
+void xf86PostButtonEvent(DeviceIntPtr device, int is_absolute, int button,
+			 int is_down, int first_valuator, int num_valuators,
+			 ...);
+void xf86PostKeyboardEvent(DeviceIntPtr device, unsigned int key_code,
+			   int is_down);
+Bool xf86InitValuatorAxisStruct(DeviceIntPtr dev, int axnum, Atom label,
+				int minval, int maxval, int resolution,
+				int min_res, int max_res, int mode);
+void xf86InitValuatorDefaults(DeviceIntPtr dev, int axnum);
+
+Bool InitValuatorClassDeviceStruct(DeviceIntPtr device, int num_axes,
+				   Atom *labels, int num_motion_events,
+				   int mode);
+Bool InitButtonClassDeviceStruct(DeviceIntPtr device, int num_buttons,
+				 Atom *labels, CARD8 *map);
+Bool InitKeyboardDeviceStruct(DeviceIntPtr device, XkbRMLVOSet *rmlvo,
+			      void *bell_func, void *ctrl_func);
+Bool InitKeyboardDeviceStructFromString(DeviceIntPtr device,
+					const char *keymap, int keymap_length,
+					void *bell_func, void *ctrl_func);
+Bool SetScrollValuator(DeviceIntPtr dev, int axnum, enum ScrollType type,
+		       double increment, int flags);
+int GetMotionHistorySize(void);
+void XkbFreeRMLVOSet(XkbRMLVOSet *rmlvo, Bool free_rmlvo);
+Bool XkbCopyDeviceKeymap(DeviceIntPtr dst, DeviceIntPtr src);
+
+Atom MakeAtom(const char *string, unsigned int len, Bool make_it);
+Atom XIGetKnownProperty(const char *name);
+int XIChangeDeviceProperty(DeviceIntPtr dev, Atom property, Atom type,
+			   int format, int mode, unsigned long len,
+			   const void *value, Bool sendevent);
+int XISetDevicePropertyDeletable(DeviceIntPtr dev, Atom property,
+				 Bool deletable);
+long XIRegisterPropertyHandler(DeviceIntPtr dev,
+			       int (*set)(DeviceIntPtr dev, Atom property,
+					  XIPropertyValuePtr prop,
+					  BOOL checkonly),
+			       int (*get)(DeviceIntPtr dev, Atom property),
+			       int (*del)(DeviceIntPtr dev, Atom property));
+
+ValuatorMask *valuator_mask_new(int num_valuators);
+void valuator_mask_free(ValuatorMask **mask);
+void valuator_mask_zero(ValuatorMask *mask);
+void valuator_mask_set(ValuatorMask *mask, int valuator, int data);
+void valuator_mask_set_double(ValuatorMask *mask, int valuator, double data);
+
+OsTimerPtr TimerSet(OsTimerPtr timer, int flags, CARD32 millis,
+		    OsTimerCallback func, void *arg);
+void TimerCancel(OsTimerPtr timer);
+void TimerFree(OsTimerPtr timer);
+CARD32 GetTimeInMillis(void);
+void input_lock(void);
+void input_unlock(void);
+
+int AllocDevicePair(ClientPtr client, const char *name, DeviceIntPtr *ptr,
+		    DeviceIntPtr *keybd, DeviceProc ptr_proc,
+		    DeviceProc keybd_proc, Bool master);
+int CorePointerProc(DeviceIntPtr device, int what);
+int CoreKeyboardProc(DeviceIntPtr device, int what);
+int ActivateDevice(DeviceIntPtr device, BOOL sendevent);
+Bool EnableDevice(DeviceIntPtr device, BOOL sendevent);
+int RemoveDevice(DeviceIntPtr dev, BOOL sendevent);
+int AttachDevice(ClientPtr client, DeviceIntPtr slave, DeviceIntPtr master);
+Bool IsMaster(DeviceIntPtr dev);
+int dixLookupDevice(DeviceIntPtr *dev, int id, ClientPtr client,
+		    Mask access_mode);
+
+#endif /* XWIIMOTE_STUB_XORG_SERVER_H */
@@ -30,12 +30,23 @@
 #include <xorg-server.h>
 #include <errno.h>
 #include <exevents.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <libudev.h>
+#include <limits.h>
 #include <linux/input.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <X11/Xatom.h>
 #include <xf86.h>
 #include <xf86Module.h>
 #include <xf86Xinput.h>
@@ -45,18 +56,174 @@
 #include <xserver-properties.h>
 #include <xwiimote.h>
 
+/*
+ * Static tracepoints for perf and bpftrace. A probe is a single nop unless a
+ * tracer is attached, so they are always compiled in if available.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define XWIIMOTE_PROBE(name, ...) STAP_PROBEV(xwiimote, name, ##__VA_ARGS__)
+#else
+#define XWIIMOTE_PROBE(name, ...) do { } while (0)
+#endif
+
 #define MIN_KEYCODE 8
+#define MAX_KEYCODE 255
+
+#if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 14
+#define HAVE_SMOOTH_SCROLLING 1
+#endif
+
+#if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 19
+#define HAVE_KEYMAP_STRING 1
+#endif
 
-#define XWIIMOTE_ACCEL_HISTORY_NUM 12
+#if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 23
+#define HAVE_THREADED_INPUT 1
+#endif
+
+#define XWIIMOTE_ACCEL_HISTORY_NUM 64
 #define XWIIMOTE_ACCEL_HISTORY_MOD 2
+#define XWIIMOTE_ACCEL_HISTORY_MS 120
+/* the history ring must cover the window at the fastest report rate */
+#define XWIIMOTE_ACCEL_MIN_INTERVAL_MS 5
+#define XWIIMOTE_ACCEL_HISTORY_MAX_MS \
+	(XWIIMOTE_ACCEL_HISTORY_NUM * XWIIMOTE_ACCEL_MIN_INTERVAL_MS)
+
+#define XWIIMOTE_ACCEL_TILT_RES 1000
+#define XWIIMOTE_ACCEL_TILT_RANGE 30
+#define XWIIMOTE_ACCEL_SMOOTH_MS 40
+#define XWIIMOTE_ACCEL_DEADBAND 3
+
+#define XWIIMOTE_ACCEL_JOY_STEPS 256
+#define XWIIMOTE_ACCEL_JOY_DEADZONE 5
+#define XWIIMOTE_ACCEL_JOY_SPEED 1500
+#define XWIIMOTE_ACCEL_JOY_CURVE 2.0
 
 #define XWIIMOTE_IR_AVG_RADIUS 10
-#define XWIIMOTE_IR_AVG_MAX_SAMPLES 8
-#define XWIIMOTE_IR_AVG_MIN_SAMPLES 4
+#define XWIIMOTE_IR_AVG_MAX_MS 80
+#define XWIIMOTE_IR_AVG_MIN_MS 40
 #define XWIIMOTE_IR_AVG_WEIGHT 3
 
+/* nominal report interval, used until the real rate has been measured */
+#define XWIIMOTE_RATE_DEFAULT_US 10000
+/* larger gaps are treated as a stream restart, not as a slow report */
+#define XWIIMOTE_RATE_MAX_GAP_US 100000
+
 #define XWIIMOTE_IR_KEYMAP_EXPIRY_SECS 1
 
+#define XWIIMOTE_MOTION_HISTORY_NUM 16
+#define XWIIMOTE_CLICK_LOCK_LOOKBACK_MS 30
+
+#define XWIIMOTE_PRECISION_GAIN 25
+#define XWIIMOTE_PRECISION_SMOOTHING 4
+
+#define XWIIMOTE_SCROLL_INCREMENT 20
+#define XWIIMOTE_SCROLL_DECAY_MS 400
+#define XWIIMOTE_SCROLL_FRAME_MS 16
+/* kinetic scrolling stops below this speed, in units per ms */
+#define XWIIMOTE_SCROLL_MIN_VEL 0.02
+
+#define XWIIMOTE_STICK_RES 100
+#define XWIIMOTE_STICK_DEADZONE 10
+#define XWIIMOTE_STICK_SPEED 1000
+#define XWIIMOTE_STICK_CURVE 2.0
+/* nominal stick ranges, extended at runtime if a stick reports more */
+#define XWIIMOTE_NUNCHUK_RANGE 100
+#define XWIIMOTE_CLASSIC_LEFT_RANGE 30
+#define XWIIMOTE_CLASSIC_RIGHT_RANGE 15
+#define XWIIMOTE_PRO_RANGE 1024
+/* center of pressure in 1/1000 of the half board size */
+#define XWIIMOTE_BOARD_RES 1000
+#define XWIIMOTE_BOARD_RANGE 400
+/* load in 10g units below which nobody stands on the board */
+#define XWIIMOTE_BOARD_MIN_LOAD 1000
+#define XWIIMOTE_BOARD_TARE_NUM 16
+
+#define XWIIMOTE_GESTURE_THRESHOLD 150
+#define XWIIMOTE_GESTURE_COOLDOWN_MS 300
+/* a swing or shake ends once acceleration stayed low for this long */
+#define XWIIMOTE_GESTURE_SETTLE_MS 100
+#define XWIIMOTE_GESTURE_GRAVITY_MS 200
+#define XWIIMOTE_GESTURE_SHAKE_REVERSALS 3
+#define XWIIMOTE_TWIST_ANGLE 60
+#define XWIIMOTE_TWIST_MS 300
+
+#define XWIIMOTE_KEY_RESOLVE_MS 250
+
+#define XWIIMOTE_IDLE_MOTION_THRESHOLD 4
+/* interfaces that are closed while the device is idle */
+#define XWIIMOTE_IDLE_IFACES \
+	(XWII_IFACE_ACCEL | XWII_IFACE_IR | XWII_IFACE_MOTION_PLUS)
+
+/*
+ * Extra valuators: raw accel XYZ, MotionPlus XYZ and 4 IR dots X/Y/valid,
+ * followed by the computed pitch, roll and yaw in 1/100 degrees.
+ */
+enum raw_axis {
+	RAW_ACCEL = 0,
+	RAW_MOTIONPLUS = 3,
+	RAW_IR = 6,
+	RAW_ORIENT = 18,
+	RAW_NUM = 21,
+};
+
+#define XWIIMOTE_MP_UNITS_PER_DEG 248
+
+#ifndef XWIIMOTE_CALIBRATION_FILE
+#define XWIIMOTE_CALIBRATION_FILE "/var/lib/xwiimote/calibration"
+#endif
+#define XWIIMOTE_CALIB_NUM 5
+#define XWIIMOTE_CALIB_LINE 128
+#define XWIIMOTE_CALIB_SAVE_SECS 60
+
+/*
+ * Recorder file: a rec_header followed by a ring of capacity rec_records.
+ * Record i is stored at index i % capacity, head is the number of records
+ * written so far. Input records hold the xwii_event type and payload as
+ * reported by libxwiimote, output records the posted values.
+ */
+#define XWIIMOTE_REC_MAGIC "XWIIREC"
+#define XWIIMOTE_REC_VERSION 1
+#define XWIIMOTE_REC_CAPACITY 65536
+
+enum rec_kind {
+	REC_INPUT,
+	REC_MOTION,		/* absolute, x, y */
+	REC_BUTTON,		/* absolute, button, state */
+	REC_KEY,		/* keycode, state */
+	REC_SCROLL,		/* dx, dy in 1/1000 increments */
+	REC_RAW,		/* absolute */
+};
+
+struct rec_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint32_t reserved;
+	uint64_t head;
+};
+
+struct rec_record {
+	int64_t sec;
+	int64_t usec;
+	uint32_t kind;
+	uint32_t type;
+	union {
+		uint8_t data[128];
+		int32_t val[3];
+	} u;
+};
+
+#define XWIIMOTE_MPX_NUM 16
+#define XWIIMOTE_MPX_LINGER_SECS 30
+
+#define XWIIMOTE_PROP_IDLE "Wii Remote Idle"
+#define XWIIMOTE_PROP_GESTURES "Wii Remote Gestures"
+#define XWIIMOTE_PROP_RECORD "Wii Remote Record"
+#define XWIIMOTE_CHORD_NUM 4
+
 #define XWIIMOTE_DISTSQ(ax, ay, bx, by) \
 	((ax - bx) * (ax - bx) + (ay - by) * (ay - by))
 
@@ -66,6 +233,8 @@ enum func_type {
 	FUNC_IGNORE,
 	FUNC_BTN,
 	FUNC_KEY,
+	FUNC_PRECISION,
+	FUNC_SCROLL,
 };
 
 struct func {
@@ -101,36 +270,215 @@ enum motion_source {
 	SOURCE_ACCEL,
 	SOURCE_IR,
 	SOURCE_MOTIONPLUS,
+	SOURCE_NUNCHUK,
+	SOURCE_CONTROLLER,
+	SOURCE_BOARD,
+};
+
+enum stick_mode {
+	STICK_OFF,
+	STICK_MOTION,
+	STICK_SCROLL,
 };
 
-enum keyset {
-	KEYSET_NORMAL,
-	KEYSET_IR,
+/*
+ * Left and right are the sticks of a Classic or Pro Controller, the Balance
+ * Board acts as a stick by leaning.
+ */
+enum stick_id {
+	STICK_NUNCHUK,
+	STICK_LEFT,
+	STICK_RIGHT,
+	STICK_BOARD,
+	STICK_NUM,
+};
 
-	KEYSET_NUM
+static const char *stick_names[STICK_NUM] = {
+	[STICK_NUNCHUK] = "NunchukStick",
+	[STICK_LEFT] = "LeftStick",
+	[STICK_RIGHT] = "RightStick",
+	[STICK_BOARD] = "BoardLean",
 };
 
-struct xwiimote_dev {
-	InputInfoPtr info;
-	void *handler;
-	int dev_id;
+struct stick {
+	enum stick_mode mode;
+	int x;
+	int y;
+	int range;
+};
+
+enum accel_mode {
+	ACCEL_MINIMUM,
+	ACCEL_TILT,
+	ACCEL_JOYSTICK,
+};
+
+/* Online estimate of the report interval of one event stream */
+struct rate_est {
+	struct timeval last;
+	int interval;
+};
+
+struct motion_sample {
+	struct timeval time;
+	int32_t x;
+	int32_t y;
+};
+
+#define XWIIMOTE_LAYER_NUM 8
+
+enum layer_select {
+	LAYER_SELECT_NONE,
+	LAYER_SELECT_IR,
+	LAYER_SELECT_KEY,
+	LAYER_SELECT_EXTENSION,
+};
+
+/* Layer 0 is always active, layer 1 is the IR layer by default */
+struct layer {
+	unsigned int select;
+	unsigned int key;
+	char *extension;
+};
+
+enum key_state {
+	KEY_STATE_UP,
+	KEY_STATE_PENDING,
+	KEY_STATE_NORMAL,
+	KEY_STATE_HOLD,
+	KEY_STATE_LONG,
+	KEY_STATE_CHORD,
+	KEY_STATE_SWALLOW,
+};
+
+/* Two buttons pressed within the resolve time trigger a separate function */
+struct key_chord {
+	unsigned int a;
+	unsigned int b;
+	struct func func;
+};
+
+enum gesture {
+	GESTURE_SHAKE,
+	GESTURE_SWING_LEFT,
+	GESTURE_SWING_RIGHT,
+	GESTURE_SWING_BACKWARD,
+	GESTURE_SWING_FORWARD,
+	GESTURE_SWING_DOWN,
+	GESTURE_SWING_UP,
+	GESTURE_TWIST_LEFT,
+	GESTURE_TWIST_RIGHT,
+
+	GESTURE_NUM
+};
+
+static const char *gesture_names[GESTURE_NUM] = {
+	[GESTURE_SHAKE] = "Shake",
+	[GESTURE_SWING_LEFT] = "SwingLeft",
+	[GESTURE_SWING_RIGHT] = "SwingRight",
+	[GESTURE_SWING_BACKWARD] = "SwingBackward",
+	[GESTURE_SWING_FORWARD] = "SwingForward",
+	[GESTURE_SWING_DOWN] = "SwingDown",
+	[GESTURE_SWING_UP] = "SwingUp",
+	[GESTURE_TWIST_LEFT] = "TwistLeft",
+	[GESTURE_TWIST_RIGHT] = "TwistRight",
+};
+
+static const struct wii_key_name {
+	const char *name;
+	unsigned int code;
+} wii_keys[] = {
+	{ "Left", XWII_KEY_LEFT },
+	{ "Right", XWII_KEY_RIGHT },
+	{ "Up", XWII_KEY_UP },
+	{ "Down", XWII_KEY_DOWN },
+	{ "A", XWII_KEY_A },
+	{ "B", XWII_KEY_B },
+	{ "Plus", XWII_KEY_PLUS },
+	{ "Minus", XWII_KEY_MINUS },
+	{ "Home", XWII_KEY_HOME },
+	{ "One", XWII_KEY_ONE },
+	{ "Two", XWII_KEY_TWO },
+	{ "C", XWII_KEY_C },
+	{ "Z", XWII_KEY_Z },
+	{ "X", XWII_KEY_X },
+	{ "Y", XWII_KEY_Y },
+	{ "TL", XWII_KEY_TL },
+	{ "TR", XWII_KEY_TR },
+	{ "ZL", XWII_KEY_ZL },
+	{ "ZR", XWII_KEY_ZR },
+	{ "ThumbL", XWII_KEY_THUMBL },
+	{ "ThumbR", XWII_KEY_THUMBR },
+	{ NULL, 0 },
+};
+
+/*
+ * A master pointer/keyboard pair owned by one Wii Remote in MPX mode. Masters
+ * are keyed by the HID root so a reconnecting remote gets its old cursor back.
+ * Devices are referenced by id since clients can remove masters at any time.
+ * Ids are reused, so lookups also check the name and the server generation.
+ */
+struct mpx_master {
 	char *root;
-	const char *device;
-	bool dup;
-	struct xwii_iface *iface;
-	unsigned int ifs;
+	int ptr_id;
+	int kbd_id;
+	unsigned long generation;
+	struct xwiimote_dev *owner;
+	OsTimerPtr timer;
+};
 
-	XkbRMLVOSet rmlvo;
+/*
+ * With DirectInput the accelerometer and IR event nodes are read by the driver
+ * itself instead of going through xwii_iface_dispatch(). The event of each node
+ * doubles as cache for the last reported values since evdev drops repeats.
+ */
+enum direct_id {
+	DIRECT_ACCEL,
+	DIRECT_IR,
+	DIRECT_NUM,
+};
+
+struct direct_node {
+	int fd;
+	void *handler;
+	bool dropped;
+	struct xwii_event ev;
+};
+
+#define XWIIMOTE_CACHE_LINE 64
+#define XWIIMOTE_CACHE_ALIGNED __attribute__((aligned(XWIIMOTE_CACHE_LINE)))
+
+#define XWIIMOTE_DIRECT_IFACES (XWII_IFACE_ACCEL | XWII_IFACE_IR)
+#define XWIIMOTE_DIRECT_BATCH 64
+
+/*
+ * Device state is split in two blocks, each starting on its own cache line.
+ * The first holds everything the input handlers touch. It starts with the
+ * fields every IR and accelerometer report uses, so such a report touches
+ * four cache lines, and ends with the history buffers, the direct nodes and
+ * the key maps. The second block holds everything only used during setup,
+ * hotplug and property changes. See bench/layout.c for a benchmark.
+ */
+struct xwiimote_dev {
+	/* per-event state, the fields used by every report first */
+	InputInfoPtr info XWIIMOTE_CACHE_ALIGNED;
+	struct xwii_iface *iface;
+	bool dup;
+	bool rec_on;
+	bool raw_used;
+	bool gestures;
+	bool orientation;
 	unsigned int motion;
 	unsigned int motion_source;
-	struct func map_key[KEYSET_NUM][XWII_KEY_NUM];
-	enum keyset key_pressed[XWII_KEY_NUM];
-	unsigned int mp_x;
-	unsigned int mp_y;
-	unsigned int mp_z;
-	int mp_x_scale;
-	int mp_y_scale;
-	int mp_z_scale;
+	int idle_timeout_secs;
+	uint32_t raw_changed;
+	/* number of held precision modifiers, motion is scaled while > 0 */
+	int precision_held;
+	/* number of held scroll buttons, motion scrolls while > 0 */
+	int scroll_held;
+	int motion_history_cur;
+	struct timeval click_lock_until;
+	int motion_frame_ms;
 
 	struct timeval ir_last_valid_event;
 	int ir_vec_x;
@@ -139,16 +487,196 @@ struct xwiimote_dev {
 	int ir_ref_y;
 	int ir_avg_x;
 	int ir_avg_y;
-	int ir_avg_count;
-
+	int ir_avg_time;
+	struct rate_est ir_rate;
 	int ir_avg_radius;
-	int ir_avg_max_samples;
-	int ir_avg_min_samples;
+	int ir_avg_max_ms;
+	int ir_avg_min_ms;
 	int ir_avg_weight;
 	int ir_keymap_expiry_secs;
 
-	struct xwii_event_abs accel_history_ev[XWIIMOTE_ACCEL_HISTORY_NUM];
+	unsigned int accel_mode;
 	int accel_history_cur;
+	int accel_history_ms;
+	struct rate_est accel_rate;
+	struct xwii_event_abs accel_med[3];
+	int accel_med_cur;
+	bool accel_med_valid;
+	bool accel_tilt_valid;
+	double accel_pos[2];
+	double accel_vel[2];
+	int accel_out[2];
+	int accel_tilt_range;
+	int accel_smooth_ms;
+	int accel_deadband;
+	double accel_joy_rem[2];
+
+	unsigned int mp_x;
+	unsigned int mp_y;
+	unsigned int mp_z;
+	int mp_x_scale;
+	int mp_y_scale;
+	int mp_z_scale;
+	int mp_units_per_deg;
+	double orient_yaw;
+	struct rate_est orient_rate;
+
+	/* paced output: at most one motion event per frame */
+	OsTimerPtr motion_timer;
+	bool motion_timer_armed;
+	bool motion_pending;
+	int motion_pending_abs;
+	int motion_pending_x;
+	int motion_pending_y;
+
+	int click_lock_ms;
+	int click_lock_lookback_ms;
+	int precision_anchor_x;
+	int precision_anchor_y;
+	double precision_rem[2];
+	int precision_gain;
+	int precision_smoothing;
+	/* low-pass for sources without a filter of their own, see below */
+	double precision_filt[4];
+	unsigned int precision_filt_valid;
+
+	int scroll_axis;
+	bool scroll_last_valid;
+	int scroll_last_x;
+	int scroll_last_y;
+	struct timeval scroll_last_time;
+	double scroll_vel[2];
+	CARD32 scroll_kinetic_last;
+	OsTimerPtr scroll_timer;
+	ValuatorMask *scroll_vals;
+	int scroll_increment;
+	int scroll_decay_ms;
+
+	struct rate_est gesture_rate;
+	bool gesture_grav_valid;
+	double gesture_grav[3];
+	bool gesture_active;
+	int gesture_axis;
+	int gesture_sign;
+	int gesture_last_sign;
+	int gesture_reversals;
+	struct timeval gesture_strong_time;
+	struct timeval gesture_cooldown_until;
+	double gesture_twist_ref;
+	int gesture_threshold;
+	int gesture_cooldown_ms;
+	int gesture_twist_angle;
+
+	/* motion interfaces are closed after idle_timeout_secs without use */
+	bool idle;
+	struct timeval idle_last;
+	double idle_accel_mean[3];
+	double idle_accel_var;
+	OsTimerPtr idle_timer;
+	int idle_motion_threshold;
+
+	/* layers currently selected by held keys or the extension */
+	unsigned int layer_state;
+	unsigned int layer_ir_mask;
+	unsigned int layer_ext_mask;
+	/* active layer for every combination of selected layers */
+	uint8_t layer_table[1 << XWIIMOTE_LAYER_NUM];
+
+	/* recently posted absolute positions, used to undo press-jitter */
+	struct motion_sample motion_history[XWIIMOTE_MOTION_HISTORY_NUM];
+	struct motion_sample accel_history_ev[XWIIMOTE_ACCEL_HISTORY_NUM];
+	/* pointer speed in pixels/s by tilt angle, 0 to 90 degrees */
+	float accel_joy_lut[XWIIMOTE_ACCEL_JOY_STEPS];
+
+	/* raw sensor data and orientation, posted along with pointer motion */
+	int raw_axis[RAW_NUM];
+	int32_t raw_cur[RAW_NUM];
+	int32_t raw_posted[RAW_NUM];
+	ValuatorMask *raw_vals;
+
+	struct rec_header *rec;
+	struct rec_record *rec_records;
+
+	struct direct_node direct[DIRECT_NUM];
+
+	/* analog sticks, integrated from a timer while one is deflected */
+	struct stick sticks[STICK_NUM];
+	int32_t board_tare[4];
+	int32_t board_tare_sum[4];
+	int board_tare_num;
+	float stick_lut[XWIIMOTE_STICK_RES + 1];
+	double stick_rem[2];
+	CARD32 stick_last;
+	OsTimerPtr stick_timer;
+	bool stick_timer_armed;
+
+	uint8_t key_pressed[XWII_KEY_NUM];
+	/* buttons with hold, long-press or chord functions are resolved late */
+	bool key_deferred[XWII_KEY_NUM];
+	uint8_t key_state[XWII_KEY_NUM];
+	int8_t key_chord[XWII_KEY_NUM];
+	int key_pending;
+	struct timeval key_pending_time;
+	OsTimerPtr key_timer;
+	int key_resolve_ms;
+	unsigned int layer_key_mask[XWII_KEY_NUM];
+	struct func map_key[XWIIMOTE_LAYER_NUM][XWII_KEY_NUM];
+	struct func map_hold[XWII_KEY_NUM];
+	struct func map_long[XWII_KEY_NUM];
+	struct key_chord chords[XWIIMOTE_CHORD_NUM];
+	struct func map_gesture[GESTURE_NUM];
+
+	/* setup-only state */
+	void *handler XWIIMOTE_CACHE_ALIGNED;
+	int dev_id;
+	char *root;
+	const char *device;
+	unsigned int ifs;
+	unsigned int direct_ifs;
+
+	/* interfaces are opened asynchronously, see xwiimote_open_timer() */
+	OsTimerPtr open_timer;
+	struct open_job *open_job;
+	unsigned int open_failed;
+	int open_retries;
+	bool bringup;
+	struct timeval bringup_start;
+	XkbRMLVOSet rmlvo;
+	bool minimal_keymap;
+
+	struct layer layers[XWIIMOTE_LAYER_NUM];
+
+	/* valuators beyond X/Y are allocated at configure time */
+	int axes_num;
+	unsigned int raw_ifs;
+
+	int accel_joy_deadzone;
+	int accel_joy_speed;
+	double accel_joy_curve;
+	int stick_deadzone;
+	int stick_speed;
+	double stick_curve;
+
+	bool gestures_mapped;
+	Atom gestures_prop;
+	bool idle_published;
+	Atom idle_prop;
+	unsigned int idle_ifs;
+
+	bool mpx;
+	int mpx_linger_secs;
+	struct mpx_master *master;
+
+	/* learned calibration, persisted per Bluetooth address */
+	char *uniq;
+	char *calib_file;
+	bool mp_learn;
+	bool calib_warned;
+	int32_t calib_saved[XWIIMOTE_CALIB_NUM];
+	OsTimerPtr calib_timer;
+
+	size_t rec_size;
+	Atom rec_prop;
 };
 
 /* List of all devices we know about to avoid duplicates */
@@ -197,6 +725,216 @@ static void xwiimote_rm_dev(struct xwiimote_dev *dev)
 	}
 }
 
+static struct mpx_master xwiimote_masters[XWIIMOTE_MPX_NUM];
+
+static DeviceIntPtr xwiimote_mpx_lookup(struct mpx_master *m, int id,
+					const char *suffix)
+{
+	DeviceIntPtr d;
+	char name[64];
+
+	if (id <= 0 || m->generation != serverGeneration ||
+	    dixLookupDevice(&d, id, serverClient, DixUnknownAccess) ||
+	    !IsMaster(d) || !d->name)
+		return NULL;
+
+	/* AllocDevicePair() appends " pointer" and " keyboard" */
+	snprintf(name, sizeof(name), "Wii Remote %d %s",
+		 (int)(m - xwiimote_masters) + 1, suffix);
+	if (strcmp(d->name, name))
+		return NULL;
+
+	return d;
+}
+
+static DeviceIntPtr xwiimote_mpx_create(struct mpx_master *m)
+{
+	DeviceIntPtr ptr, kbd;
+	char name[64];
+	int ret;
+
+	snprintf(name, sizeof(name), "Wii Remote %d",
+		 (int)(m - xwiimote_masters) + 1);
+
+	ret = AllocDevicePair(serverClient, name, &ptr, &kbd, CorePointerProc,
+			      CoreKeyboardProc, TRUE);
+	if (ret != Success)
+		return NULL;
+
+	ActivateDevice(ptr, TRUE);
+	ActivateDevice(kbd, TRUE);
+	EnableDevice(ptr, TRUE);
+	EnableDevice(kbd, TRUE);
+
+	m->ptr_id = ptr->id;
+	m->kbd_id = kbd->id;
+	return ptr;
+}
+
+static void xwiimote_mpx_destroy(struct mpx_master *m)
+{
+	DeviceIntPtr d;
+
+	d = xwiimote_mpx_lookup(m, m->kbd_id, "keyboard");
+	if (d)
+		RemoveDevice(d, TRUE);
+	d = xwiimote_mpx_lookup(m, m->ptr_id, "pointer");
+	if (d)
+		RemoveDevice(d, TRUE);
+
+	m->ptr_id = 0;
+	m->kbd_id = 0;
+	free(m->root);
+	m->root = NULL;
+	TimerFree(m->timer);
+	m->timer = NULL;
+}
+
+/*
+ * Masters of a previous server generation are gone. Their timers are left
+ * alone since they may not survive the reset either, the callback ignores
+ * timers it no longer owns.
+ */
+static void xwiimote_mpx_expire(void)
+{
+	struct mpx_master *m;
+	unsigned int i;
+
+	for (i = 0; i < XWIIMOTE_MPX_NUM; ++i) {
+		m = &xwiimote_masters[i];
+		if (!m->root || m->generation == serverGeneration)
+			continue;
+
+		free(m->root);
+		memset(m, 0, sizeof(*m));
+	}
+}
+
+/*
+ * Device hierarchy changes cannot be done from within the device callbacks
+ * of a slave, so attaching and the delayed removal run from a timer in the
+ * main thread.
+ */
+static CARD32 xwiimote_mpx_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	struct mpx_master *m = arg;
+	struct xwiimote_dev *dev = m->owner;
+	DeviceIntPtr ptr;
+
+	if (timer != m->timer)
+		return 0;
+
+	if (!dev) {
+		xwiimote_mpx_destroy(m);
+		return 0;
+	}
+
+	ptr = xwiimote_mpx_lookup(m, m->ptr_id, "pointer");
+	if (!ptr)
+		ptr = xwiimote_mpx_create(m);
+	if (!ptr) {
+		xf86IDrvMsg(dev->info, X_ERROR, "Cannot create master device\n");
+		return 0;
+	}
+
+	AttachDevice(NULL, dev->info->dev, ptr);
+	return 0;
+}
+
+static void xwiimote_mpx_attach(struct xwiimote_dev *dev)
+{
+	struct mpx_master *m, *free_slot = NULL;
+	unsigned int i;
+
+	xwiimote_mpx_expire();
+
+	for (i = 0; i < XWIIMOTE_MPX_NUM; ++i) {
+		m = &xwiimote_masters[i];
+		if (!m->root) {
+			if (!free_slot)
+				free_slot = m;
+		} else if (!strcmp(m->root, dev->root) && !m->owner) {
+			break;
+		}
+	}
+
+	if (i == XWIIMOTE_MPX_NUM) {
+		m = free_slot;
+		if (!m) {
+			xf86IDrvMsg(dev->info, X_ERROR, "Too many master devices\n");
+			return;
+		}
+		m->root = strdup(dev->root);
+		if (!m->root)
+			return;
+		m->generation = serverGeneration;
+	}
+
+	m->owner = dev;
+	dev->master = m;
+	m->timer = TimerSet(m->timer, 0, 1, xwiimote_mpx_timer, m);
+}
+
+/* Keep the master around for a while in case the remote reconnects */
+static void xwiimote_mpx_release(struct xwiimote_dev *dev)
+{
+	struct mpx_master *m = dev->master;
+
+	if (!m)
+		return;
+
+	dev->master = NULL;
+	m->owner = NULL;
+	m->timer = TimerSet(m->timer, 0, dev->mpx_linger_secs * 1000 + 1,
+			    xwiimote_mpx_timer, m);
+}
+
+static int xwiimote_input_lock(void)
+{
+#ifdef HAVE_THREADED_INPUT
+	input_lock();
+	return 0;
+#else
+	return xf86BlockSIGIO();
+#endif
+}
+
+static void xwiimote_input_unlock(int sigstate)
+{
+#ifdef HAVE_THREADED_INPUT
+	input_unlock();
+#else
+	xf86UnblockSIGIO(sigstate);
+#endif
+}
+
+static int64_t timeval_diff_us(const struct timeval *a,
+			       const struct timeval *b)
+{
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000 +
+	       (a->tv_usec - b->tv_usec);
+}
+
+/*
+ * Feed the timestamp of a new report into the rate estimator and return the
+ * smoothed report interval in microseconds. The first report and reports
+ * after long gaps only restart the measurement; they must not drag the
+ * estimate towards the gap length.
+ */
+static int rate_update(struct rate_est *r, const struct timeval *time)
+{
+	int64_t d;
+
+	if (r->last.tv_sec || r->last.tv_usec) {
+		d = timeval_diff_us(time, &r->last);
+		if (d > 0 && d <= XWIIMOTE_RATE_MAX_GAP_US)
+			r->interval += (int)(d - r->interval) / 8;
+	}
+
+	r->last = *time;
+	return r->interval;
+}
+
 static void cp_opt(struct xwiimote_dev *dev, const char *name, char **out)
 {
 	char *s;
@@ -210,8 +948,289 @@ static void cp_opt(struct xwiimote_dev *dev, const char *name, char **out)
 	}
 }
 
+static BOOL str_equal(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static BOOL rmlvo_equal(const XkbRMLVOSet *a, const XkbRMLVOSet *b)
+{
+	return str_equal(a->rules, b->rules) &&
+	       str_equal(a->model, b->model) &&
+	       str_equal(a->layout, b->layout) &&
+	       str_equal(a->variant, b->variant) &&
+	       str_equal(a->options, b->options);
+}
+
+/* Find a remote whose keymap was compiled from the same XKB settings. */
+static DeviceIntPtr xwiimote_keymap_source(struct xwiimote_dev *dev)
+{
+	struct xwiimote_dev **iter;
+	DeviceIntPtr src;
+
+	for (iter = xwiimote_devices; *iter; ++iter) {
+		if (*iter == dev || (*iter)->dup || (*iter)->minimal_keymap)
+			continue;
+
+		src = (*iter)->info->dev;
+		if (src && src->key && rmlvo_equal(&(*iter)->rmlvo, &dev->rmlvo))
+			return src;
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_KEYMAP_STRING
+/*
+ * Symbols of the minimal keymap. These are the symbols of the "pc+us+inet"
+ * layout on evdev for the keys a Wii Remote is likely to send. @mod is the
+ * modifier the key is bound to, if any.
+ */
+static const struct {
+	unsigned int key;
+	const char *sym;
+	const char *shift;
+	const char *mod;
+} key_syms[] = {
+	{ KEY_ESC, "Escape", NULL, NULL },
+	{ KEY_1, "1", "exclam", NULL },
+	{ KEY_2, "2", "at", NULL },
+	{ KEY_3, "3", "numbersign", NULL },
+	{ KEY_4, "4", "dollar", NULL },
+	{ KEY_5, "5", "percent", NULL },
+	{ KEY_6, "6", "asciicircum", NULL },
+	{ KEY_7, "7", "ampersand", NULL },
+	{ KEY_8, "8", "asterisk", NULL },
+	{ KEY_9, "9", "parenleft", NULL },
+	{ KEY_0, "0", "parenright", NULL },
+	{ KEY_MINUS, "minus", "underscore", NULL },
+	{ KEY_EQUAL, "equal", "plus", NULL },
+	{ KEY_BACKSPACE, "BackSpace", NULL, NULL },
+	{ KEY_TAB, "Tab", "ISO_Left_Tab", NULL },
+	{ KEY_Q, "q", "Q", NULL },
+	{ KEY_W, "w", "W", NULL },
+	{ KEY_E, "e", "E", NULL },
+	{ KEY_R, "r", "R", NULL },
+	{ KEY_T, "t", "T", NULL },
+	{ KEY_Y, "y", "Y", NULL },
+	{ KEY_U, "u", "U", NULL },
+	{ KEY_I, "i", "I", NULL },
+	{ KEY_O, "o", "O", NULL },
+	{ KEY_P, "p", "P", NULL },
+	{ KEY_LEFTBRACE, "bracketleft", "braceleft", NULL },
+	{ KEY_RIGHTBRACE, "bracketright", "braceright", NULL },
+	{ KEY_ENTER, "Return", NULL, NULL },
+	{ KEY_LEFTCTRL, "Control_L", NULL, "Control" },
+	{ KEY_A, "a", "A", NULL },
+	{ KEY_S, "s", "S", NULL },
+	{ KEY_D, "d", "D", NULL },
+	{ KEY_F, "f", "F", NULL },
+	{ KEY_G, "g", "G", NULL },
+	{ KEY_H, "h", "H", NULL },
+	{ KEY_J, "j", "J", NULL },
+	{ KEY_K, "k", "K", NULL },
+	{ KEY_L, "l", "L", NULL },
+	{ KEY_SEMICOLON, "semicolon", "colon", NULL },
+	{ KEY_APOSTROPHE, "apostrophe", "quotedbl", NULL },
+	{ KEY_GRAVE, "grave", "asciitilde", NULL },
+	{ KEY_LEFTSHIFT, "Shift_L", NULL, "Shift" },
+	{ KEY_BACKSLASH, "backslash", "bar", NULL },
+	{ KEY_Z, "z", "Z", NULL },
+	{ KEY_X, "x", "X", NULL },
+	{ KEY_C, "c", "C", NULL },
+	{ KEY_V, "v", "V", NULL },
+	{ KEY_B, "b", "B", NULL },
+	{ KEY_N, "n", "N", NULL },
+	{ KEY_M, "m", "M", NULL },
+	{ KEY_COMMA, "comma", "less", NULL },
+	{ KEY_DOT, "period", "greater", NULL },
+	{ KEY_SLASH, "slash", "question", NULL },
+	{ KEY_RIGHTSHIFT, "Shift_R", NULL, "Shift" },
+	{ KEY_KPASTERISK, "KP_Multiply", NULL, NULL },
+	{ KEY_LEFTALT, "Alt_L", NULL, "Mod1" },
+	{ KEY_SPACE, "space", NULL, NULL },
+	{ KEY_CAPSLOCK, "Caps_Lock", NULL, "Lock" },
+	{ KEY_F1, "F1", NULL, NULL },
+	{ KEY_F2, "F2", NULL, NULL },
+	{ KEY_F3, "F3", NULL, NULL },
+	{ KEY_F4, "F4", NULL, NULL },
+	{ KEY_F5, "F5", NULL, NULL },
+	{ KEY_F6, "F6", NULL, NULL },
+	{ KEY_F7, "F7", NULL, NULL },
+	{ KEY_F8, "F8", NULL, NULL },
+	{ KEY_F9, "F9", NULL, NULL },
+	{ KEY_F10, "F10", NULL, NULL },
+	{ KEY_NUMLOCK, "Num_Lock", NULL, "Mod2" },
+	{ KEY_SCROLLLOCK, "Scroll_Lock", NULL, NULL },
+	{ KEY_KP7, "KP_Home", "KP_7", NULL },
+	{ KEY_KP8, "KP_Up", "KP_8", NULL },
+	{ KEY_KP9, "KP_Prior", "KP_9", NULL },
+	{ KEY_KPMINUS, "KP_Subtract", NULL, NULL },
+	{ KEY_KP4, "KP_Left", "KP_4", NULL },
+	{ KEY_KP5, "KP_Begin", "KP_5", NULL },
+	{ KEY_KP6, "KP_Right", "KP_6", NULL },
+	{ KEY_KPPLUS, "KP_Add", NULL, NULL },
+	{ KEY_KP1, "KP_End", "KP_1", NULL },
+	{ KEY_KP2, "KP_Down", "KP_2", NULL },
+	{ KEY_KP3, "KP_Next", "KP_3", NULL },
+	{ KEY_KP0, "KP_Insert", "KP_0", NULL },
+	{ KEY_KPDOT, "KP_Delete", "KP_Decimal", NULL },
+	{ KEY_102ND, "less", "greater", NULL },
+	{ KEY_F11, "F11", NULL, NULL },
+	{ KEY_F12, "F12", NULL, NULL },
+	{ KEY_KPENTER, "KP_Enter", NULL, NULL },
+	{ KEY_RIGHTCTRL, "Control_R", NULL, "Control" },
+	{ KEY_KPSLASH, "KP_Divide", NULL, NULL },
+	{ KEY_SYSRQ, "Print", NULL, NULL },
+	{ KEY_RIGHTALT, "Alt_R", NULL, "Mod1" },
+	{ KEY_HOME, "Home", NULL, NULL },
+	{ KEY_UP, "Up", NULL, NULL },
+	{ KEY_PAGEUP, "Prior", NULL, NULL },
+	{ KEY_LEFT, "Left", NULL, NULL },
+	{ KEY_RIGHT, "Right", NULL, NULL },
+	{ KEY_END, "End", NULL, NULL },
+	{ KEY_DOWN, "Down", NULL, NULL },
+	{ KEY_PAGEDOWN, "Next", NULL, NULL },
+	{ KEY_INSERT, "Insert", NULL, NULL },
+	{ KEY_DELETE, "Delete", NULL, NULL },
+	{ KEY_MUTE, "XF86AudioMute", NULL, NULL },
+	{ KEY_VOLUMEDOWN, "XF86AudioLowerVolume", NULL, NULL },
+	{ KEY_VOLUMEUP, "XF86AudioRaiseVolume", NULL, NULL },
+	{ KEY_POWER, "XF86PowerOff", NULL, NULL },
+	{ KEY_KPEQUAL, "KP_Equal", NULL, NULL },
+	{ KEY_PAUSE, "Pause", NULL, NULL },
+	{ KEY_LEFTMETA, "Super_L", NULL, "Mod4" },
+	{ KEY_RIGHTMETA, "Super_R", NULL, "Mod4" },
+	{ KEY_COMPOSE, "Menu", NULL, NULL },
+	{ KEY_STOP, "Cancel", NULL, NULL },
+	{ KEY_UNDO, "Undo", NULL, NULL },
+	{ KEY_COPY, "XF86Copy", NULL, NULL },
+	{ KEY_OPEN, "XF86Open", NULL, NULL },
+	{ KEY_PASTE, "XF86Paste", NULL, NULL },
+	{ KEY_FIND, "Find", NULL, NULL },
+	{ KEY_CUT, "XF86Cut", NULL, NULL },
+	{ KEY_HELP, "Help", NULL, NULL },
+	{ KEY_MENU, "Menu", NULL, NULL },
+	{ KEY_CALC, "XF86Calculator", NULL, NULL },
+	{ KEY_SLEEP, "XF86Sleep", NULL, NULL },
+	{ KEY_WAKEUP, "XF86WakeUp", NULL, NULL },
+	{ KEY_WWW, "XF86WWW", NULL, NULL },
+	{ KEY_SCREENLOCK, "XF86ScreenSaver", NULL, NULL },
+	{ KEY_MAIL, "XF86Mail", NULL, NULL },
+	{ KEY_BOOKMARKS, "XF86Favorites", NULL, NULL },
+	{ KEY_COMPUTER, "XF86MyComputer", NULL, NULL },
+	{ KEY_BACK, "XF86Back", NULL, NULL },
+	{ KEY_FORWARD, "XF86Forward", NULL, NULL },
+	{ KEY_EJECTCD, "XF86Eject", NULL, NULL },
+	{ KEY_NEXTSONG, "XF86AudioNext", NULL, NULL },
+	{ KEY_PLAYPAUSE, "XF86AudioPlay", NULL, NULL },
+	{ KEY_PREVIOUSSONG, "XF86AudioPrev", NULL, NULL },
+	{ KEY_STOPCD, "XF86AudioStop", NULL, NULL },
+	{ KEY_RECORD, "XF86AudioRecord", NULL, NULL },
+	{ KEY_REWIND, "XF86AudioRewind", NULL, NULL },
+	{ KEY_HOMEPAGE, "XF86HomePage", NULL, NULL },
+	{ KEY_REFRESH, "XF86Reload", NULL, NULL },
+	{ KEY_REDO, "Redo", NULL, NULL },
+	{ KEY_PAUSECD, "XF86AudioPause", NULL, NULL },
+	{ KEY_FASTFORWARD, "XF86AudioForward", NULL, NULL },
+	{ KEY_SEARCH, "XF86Search", NULL, NULL },
+	{ KEY_MEDIA, "XF86AudioMedia", NULL, NULL },
+	{ KEY_BRIGHTNESSDOWN, "XF86MonBrightnessDown", NULL, NULL },
+	{ KEY_BRIGHTNESSUP, "XF86MonBrightnessUp", NULL, NULL },
+	{ KEY_ZOOMIN, "XF86ZoomIn", NULL, NULL },
+	{ KEY_ZOOMOUT, "XF86ZoomOut", NULL, NULL },
+	{ 0, NULL, NULL, NULL },
+};
+
+static void xwiimote_keymap_key(bool *used, const struct func *func)
+{
+	if (func->type == FUNC_KEY && func->u.key + MIN_KEYCODE <= MAX_KEYCODE)
+		used[func->u.key] = true;
+}
+
+/*
+ * Build a keymap with keycodes and symbols for the keys that are mapped and
+ * nothing else. Types and compat are the complete ones so keypad and modifier
+ * keys work as usual; they are small next to the full keycodes and symbols.
+ * Returns NULL on failure.
+ */
+static char *xwiimote_build_keymap(struct xwiimote_dev *dev)
+{
+	bool used[MAX_KEYCODE - MIN_KEYCODE + 1] = { false };
+	unsigned int i, j, num = 0;
+	size_t size, len;
+	char *buf;
+
+	for (i = 0; i < XWII_KEY_NUM; ++i) {
+		for (j = 0; j < XWIIMOTE_LAYER_NUM; ++j)
+			xwiimote_keymap_key(used, &dev->map_key[j][i]);
+		xwiimote_keymap_key(used, &dev->map_hold[i]);
+		xwiimote_keymap_key(used, &dev->map_long[i]);
+	}
+	for (i = 0; i < XWIIMOTE_CHORD_NUM; ++i)
+		xwiimote_keymap_key(used, &dev->chords[i].func);
+	for (i = 0; i < GESTURE_NUM; ++i)
+		xwiimote_keymap_key(used, &dev->map_gesture[i]);
+
+	for (i = 0; i <= MAX_KEYCODE - MIN_KEYCODE; ++i)
+		num += used[i];
+
+	/* up to three lines per key, none longer than 80 characters */
+	size = 512 + num * 3 * 80;
+	buf = malloc(size);
+	if (!buf)
+		return NULL;
+
+	len = snprintf(buf, size, "xkb_keymap {\n"
+				  "\txkb_keycodes {\n"
+				  "\t\tminimum = %d;\n"
+				  "\t\tmaximum = %d;\n",
+		       MIN_KEYCODE, MAX_KEYCODE);
+	for (i = 0; i <= MAX_KEYCODE - MIN_KEYCODE; ++i) {
+		if (used[i])
+			len += snprintf(buf + len, size - len,
+					"\t\t<K%u> = %u;\n",
+					i + MIN_KEYCODE, i + MIN_KEYCODE);
+	}
+	len += snprintf(buf + len, size - len,
+			"\t};\n"
+			"\txkb_types { include \"complete\" };\n"
+			"\txkb_compat { include \"complete\" };\n"
+			"\txkb_symbols {\n");
+	for (i = 0; key_syms[i].sym; ++i) {
+		if (key_syms[i].key + MIN_KEYCODE > MAX_KEYCODE ||
+		    !used[key_syms[i].key])
+			continue;
+		j = key_syms[i].key + MIN_KEYCODE;
+		if (key_syms[i].shift)
+			len += snprintf(buf + len, size - len,
+					"\t\tkey <K%u> { [ %s, %s ] };\n",
+					j, key_syms[i].sym, key_syms[i].shift);
+		else
+			len += snprintf(buf + len, size - len,
+					"\t\tkey <K%u> { [ %s ] };\n",
+					j, key_syms[i].sym);
+		if (key_syms[i].mod)
+			len += snprintf(buf + len, size - len,
+					"\t\tmodifier_map %s { <K%u> };\n",
+					key_syms[i].mod, j);
+	}
+	snprintf(buf + len, size - len, "\t};\n};\n");
+
+	return buf;
+}
+#endif
+
 static int xwiimote_prepare_key(struct xwiimote_dev *dev, DeviceIntPtr device)
 {
+#ifdef HAVE_KEYMAP_STRING
+	DeviceIntPtr src;
+	char *keymap;
+	BOOL ret;
+#endif
+
 	cp_opt(dev, "xkb_rules", &dev->rmlvo.rules);
 	if (!dev->rmlvo.rules)
 		cp_opt(dev, "XkbRules", &dev->rmlvo.rules);
@@ -228,6 +1247,32 @@ static int xwiimote_prepare_key(struct xwiimote_dev *dev, DeviceIntPtr device)
 	if (!dev->rmlvo.options)
 		cp_opt(dev, "XkbOptions", &dev->rmlvo.options);
 
+#ifdef HAVE_KEYMAP_STRING
+	/*
+	 * Compiling the keymap of the mapped keys only is much cheaper than a
+	 * full XKB compile, so use it as starting point whenever a remote with
+	 * the same settings already has the full keymap to copy from.
+	 */
+	src = dev->minimal_keymap ? NULL : xwiimote_keymap_source(dev);
+	if (src || dev->minimal_keymap) {
+		keymap = xwiimote_build_keymap(dev);
+		if (!keymap)
+			return BadAlloc;
+
+		ret = InitKeyboardDeviceStructFromString(device, keymap,
+							 strlen(keymap),
+							 NULL, NULL);
+		free(keymap);
+		if (!ret)
+			return BadValue;
+
+		if (src && !XkbCopyDeviceKeymap(device, src))
+			xf86IDrvMsg(dev->info, X_WARNING,
+				    "Cannot copy keymap, using minimal keymap\n");
+		return Success;
+	}
+#endif
+
 	if (!InitKeyboardDeviceStruct(device, &dev->rmlvo, NULL, NULL))
 		return BadValue;
 
@@ -266,6 +1311,99 @@ err_out:
 	return ret;
 }
 
+static const struct {
+	const char *label;
+	int min;
+	int max;
+} raw_axes[RAW_NUM] = {
+	{ "Wii Accel X", -1024, 1023 },
+	{ "Wii Accel Y", -1024, 1023 },
+	{ "Wii Accel Z", -1024, 1023 },
+	{ "Wii MotionPlus X", -32768, 32767 },
+	{ "Wii MotionPlus Y", -32768, 32767 },
+	{ "Wii MotionPlus Z", -32768, 32767 },
+	{ "Wii IR 1 X", 0, 1023 },
+	{ "Wii IR 1 Y", 0, 767 },
+	{ "Wii IR 1 Valid", 0, 1 },
+	{ "Wii IR 2 X", 0, 1023 },
+	{ "Wii IR 2 Y", 0, 767 },
+	{ "Wii IR 2 Valid", 0, 1 },
+	{ "Wii IR 3 X", 0, 1023 },
+	{ "Wii IR 3 Y", 0, 767 },
+	{ "Wii IR 3 Valid", 0, 1 },
+	{ "Wii IR 4 X", 0, 1023 },
+	{ "Wii IR 4 Y", 0, 767 },
+	{ "Wii IR 4 Valid", 0, 1 },
+	{ "Wii Pitch", -9000, 9000 },
+	{ "Wii Roll", -18000, 18000 },
+	{ "Wii Yaw", -18000, 18000 },
+};
+
+/* Set the labels of all valuators behind the X/Y axes */
+static void xwiimote_label_axes(struct xwiimote_dev *dev, Atom *atoms)
+{
+	char hwheel[] = AXIS_LABEL_PROP_REL_HWHEEL;
+	char wheel[] = AXIS_LABEL_PROP_REL_WHEEL;
+	const char *label;
+	unsigned int i;
+
+	if (dev->scroll_axis >= 0) {
+		atoms[dev->scroll_axis] = XIGetKnownProperty(hwheel);
+		atoms[dev->scroll_axis + 1] = XIGetKnownProperty(wheel);
+	}
+
+	for (i = 0; i < RAW_NUM; ++i) {
+		if (dev->raw_axis[i] < 0)
+			continue;
+		label = raw_axes[i].label;
+		atoms[dev->raw_axis[i]] = MakeAtom(label, strlen(label), TRUE);
+	}
+}
+
+static int xwiimote_init_axes(struct xwiimote_dev *dev, DeviceIntPtr device,
+			      Atom *atoms)
+{
+	unsigned int i;
+	int axis;
+
+	if (dev->scroll_axis >= 0) {
+		dev->scroll_vals = valuator_mask_new(dev->axes_num);
+		if (!dev->scroll_vals)
+			return BadAlloc;
+
+		axis = dev->scroll_axis;
+		xf86InitValuatorAxisStruct(device, axis, atoms[axis],
+					   -1, -1, 0, 0, 0, Relative);
+		xf86InitValuatorAxisStruct(device, axis + 1, atoms[axis + 1],
+					   -1, -1, 0, 0, 0, Relative);
+#ifdef HAVE_SMOOTH_SCROLLING
+		SetScrollValuator(device, axis, SCROLL_TYPE_HORIZONTAL,
+				  dev->scroll_increment, SCROLL_FLAG_NONE);
+		SetScrollValuator(device, axis + 1, SCROLL_TYPE_VERTICAL,
+				  dev->scroll_increment, SCROLL_FLAG_PREFERRED);
+#endif
+	}
+
+	if (dev->raw_used) {
+		dev->raw_vals = valuator_mask_new(dev->axes_num);
+		if (!dev->raw_vals)
+			return BadAlloc;
+
+		/* raw axes report positions even on relative devices */
+		for (i = 0; i < RAW_NUM; ++i) {
+			axis = dev->raw_axis[i];
+			if (axis < 0)
+				continue;
+			xf86InitValuatorAxisStruct(device, axis, atoms[axis],
+						   raw_axes[i].min,
+						   raw_axes[i].max,
+						   0, 0, 0, Absolute);
+		}
+	}
+
+	return Success;
+}
+
 static int xwiimote_prepare_abs(struct xwiimote_dev *dev, DeviceIntPtr device, int xmin, int xmax, int ymin, int ymax)
 {
 	Atom *atoms;
@@ -273,7 +1411,7 @@ static int xwiimote_prepare_abs(struct xwiimote_dev *dev, DeviceIntPtr device, i
 	char absx[] = AXIS_LABEL_PROP_ABS_X;
 	char absy[] = AXIS_LABEL_PROP_ABS_Y;
 
-	num = 2;
+	num = dev->axes_num;
 	atoms = malloc(sizeof(*atoms) * num);
 	if (!atoms)
 		return BadAlloc;
@@ -281,6 +1419,7 @@ static int xwiimote_prepare_abs(struct xwiimote_dev *dev, DeviceIntPtr device, i
 	memset(atoms, 0, sizeof(*atoms) * num);
 	atoms[0] = XIGetKnownProperty(absx);
 	atoms[1] = XIGetKnownProperty(absy);
+	xwiimote_label_axes(dev, atoms);
 
 	if (!InitValuatorClassDeviceStruct(device, num, atoms,
 					GetMotionHistorySize(), Absolute)) {
@@ -293,6 +1432,7 @@ static int xwiimote_prepare_abs(struct xwiimote_dev *dev, DeviceIntPtr device, i
 	xf86InitValuatorDefaults(device, 0);
 	xf86InitValuatorAxisStruct(device, 1, atoms[1], ymin, ymax, 0, 0, 0, Absolute);
 	xf86InitValuatorDefaults(device, 1);
+	ret = xwiimote_init_axes(dev, device, atoms);
 
 err_out:
 	free(atoms);
@@ -306,7 +1446,7 @@ static int xwiimote_prepare_rel(struct xwiimote_dev *dev, DeviceIntPtr device, i
 	char relx[] = AXIS_LABEL_PROP_REL_X;
 	char rely[] = AXIS_LABEL_PROP_REL_Y;
 
-	num = 2;
+	num = dev->axes_num;
 	atoms = malloc(sizeof(*atoms) * num);
 	if (!atoms)
 		return BadAlloc;
@@ -314,6 +1454,7 @@ static int xwiimote_prepare_rel(struct xwiimote_dev *dev, DeviceIntPtr device, i
 	memset(atoms, 0, sizeof(*atoms) * num);
 	atoms[0] = XIGetKnownProperty(relx);
 	atoms[1] = XIGetKnownProperty(rely);
+	xwiimote_label_axes(dev, atoms);
 
 	if (!InitValuatorClassDeviceStruct(device, num, atoms,
 					   GetMotionHistorySize(),
@@ -327,19 +1468,703 @@ static int xwiimote_prepare_rel(struct xwiimote_dev *dev, DeviceIntPtr device, i
 	xf86InitValuatorDefaults(device, 0);
 	xf86InitValuatorAxisStruct(device, 1, atoms[1], ymin, ymax, 0, 0, 0, Relative);
 	xf86InitValuatorDefaults(device, 1);
+	ret = xwiimote_init_axes(dev, device, atoms);
 
 err_out:
 	free(atoms);
 	return ret;
 }
 
-static int xwiimote_init(struct xwiimote_dev *dev, DeviceIntPtr device)
+static unsigned int xwiimote_active_ifs(struct xwiimote_dev *dev)
 {
-	int ret;
+	if (dev->idle)
+		return dev->ifs & ~dev->idle_ifs;
+	return dev->ifs;
+}
 
-	ret = xwiimote_prepare_key(dev, device);
-	if (ret != Success)
-		return ret;
+static bool xwiimote_key_used(struct xwiimote_dev *dev, unsigned int code)
+{
+	unsigned int i;
+
+	for (i = 0; i < XWIIMOTE_LAYER_NUM; ++i) {
+		if (dev->map_key[i][code].type != FUNC_IGNORE)
+			return true;
+	}
+
+	return dev->key_deferred[code];
+}
+
+/*
+ * Compute the minimal set of interfaces the configuration needs. Every open
+ * interface adds data to each report, so nothing is opened just in case.
+ */
+static void xwiimote_update_ifs(struct xwiimote_dev *dev)
+{
+	unsigned int ifs = XWII_IFACE_CORE, i, code;
+	bool controller;
+
+	switch (dev->motion_source) {
+	case SOURCE_ACCEL:
+		ifs |= XWII_IFACE_ACCEL;
+		break;
+	case SOURCE_IR:
+		ifs |= XWII_IFACE_IR;
+		break;
+	case SOURCE_MOTIONPLUS:
+		ifs |= XWII_IFACE_MOTION_PLUS;
+		break;
+	}
+
+	/* IR visibility only matters if an IR layer maps anything differently */
+	for (i = 1; i < XWIIMOTE_LAYER_NUM; ++i) {
+		if (!(dev->layer_ir_mask & (1U << i)))
+			continue;
+		for (code = 0; code < XWII_KEY_NUM; ++code) {
+			if (memcmp(&dev->map_key[i][code], &dev->map_key[0][code],
+				   sizeof(struct func)))
+				ifs |= XWII_IFACE_IR;
+		}
+	}
+
+	if (dev->gestures)
+		ifs |= XWII_IFACE_ACCEL;
+
+	if (dev->sticks[STICK_NUNCHUK].mode != STICK_OFF ||
+	    xwiimote_key_used(dev, XWII_KEY_C) ||
+	    xwiimote_key_used(dev, XWII_KEY_Z))
+		ifs |= XWII_IFACE_NUNCHUK;
+
+	/* controller buttons share the mappings of the Wii Remote buttons */
+	controller = dev->sticks[STICK_LEFT].mode != STICK_OFF ||
+		     dev->sticks[STICK_RIGHT].mode != STICK_OFF;
+	for (code = 0; code < XWII_KEY_NUM && !controller; ++code) {
+		if (code == XWII_KEY_ONE || code == XWII_KEY_TWO ||
+		    code == XWII_KEY_C || code == XWII_KEY_Z)
+			continue;
+		controller = xwiimote_key_used(dev, code);
+	}
+	if (controller)
+		ifs |= XWII_IFACE_CLASSIC_CONTROLLER |
+		       XWII_IFACE_PRO_CONTROLLER;
+
+	if (dev->sticks[STICK_BOARD].mode != STICK_OFF)
+		ifs |= XWII_IFACE_BALANCE_BOARD;
+
+	ifs |= dev->raw_ifs;
+	if (dev->orientation)
+		ifs |= XWII_IFACE_ACCEL | XWII_IFACE_MOTION_PLUS;
+
+	dev->ifs = ifs;
+}
+
+static void xwiimote_handle(struct xwiimote_dev *dev, struct xwii_event *ev);
+
+static const char *direct_names[DIRECT_NUM] = {
+	[DIRECT_ACCEL] = XWII_NAME_ACCEL,
+	[DIRECT_IR] = XWII_NAME_IR,
+};
+
+static const unsigned int direct_ifaces[DIRECT_NUM] = {
+	[DIRECT_ACCEL] = XWII_IFACE_ACCEL,
+	[DIRECT_IR] = XWII_IFACE_IR,
+};
+
+/* first and last ABS code reported by each node */
+static const unsigned int direct_codes[DIRECT_NUM][2] = {
+	[DIRECT_ACCEL] = { ABS_RX, ABS_RZ },
+	[DIRECT_IR] = { ABS_HAT0X, ABS_HAT3Y },
+};
+
+/* Find the event node of the input device @name below our HID device. */
+static char *xwiimote_direct_path(const char *syspath, const char *name)
+{
+	struct udev *udev;
+	struct udev_device *root, *d, *p;
+	struct udev_enumerate *e;
+	struct udev_list_entry *entry;
+	const char *node, *sysname, *pname;
+	char *path = NULL;
+
+	udev = udev_new();
+	if (!udev)
+		return NULL;
+
+	root = udev_device_new_from_syspath(udev, syspath);
+	if (!root)
+		goto err_udev;
+
+	e = udev_enumerate_new(udev);
+	if (!e)
+		goto err_root;
+
+	udev_enumerate_add_match_subsystem(e, "input");
+	udev_enumerate_add_match_parent(e, root);
+	udev_enumerate_scan_devices(e);
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+		d = udev_device_new_from_syspath(udev,
+						 udev_list_entry_get_name(entry));
+		if (!d)
+			continue;
+
+		sysname = udev_device_get_sysname(d);
+		node = udev_device_get_devnode(d);
+		p = udev_device_get_parent_with_subsystem_devtype(d, "input", NULL);
+		pname = p ? udev_device_get_sysattr_value(p, "name") : NULL;
+		if (sysname && !strncmp(sysname, "event", 5) && node &&
+		    pname && !strcmp(pname, name))
+			path = strdup(node);
+
+		udev_device_unref(d);
+		if (path)
+			break;
+	}
+
+	udev_enumerate_unref(e);
+err_root:
+	udev_device_unref(root);
+err_udev:
+	udev_unref(udev);
+	return path;
+}
+
+static void direct_set(struct direct_node *n, unsigned int id,
+		       unsigned int code, int32_t value)
+{
+	unsigned int i;
+
+	if (code < direct_codes[id][0] || code > direct_codes[id][1])
+		return;
+
+	i = code - direct_codes[id][0];
+	if (id == DIRECT_ACCEL) {
+		if (i == 0)
+			n->ev.v.abs[0].x = value;
+		else if (i == 1)
+			n->ev.v.abs[0].y = value;
+		else
+			n->ev.v.abs[0].z = value;
+	} else {
+		if (i % 2)
+			n->ev.v.abs[i / 2].y = value;
+		else
+			n->ev.v.abs[i / 2].x = value;
+	}
+}
+
+/* Reload the cached values after opening the node or losing events. */
+static void xwiimote_direct_resync(struct xwiimote_dev *dev, unsigned int id)
+{
+	struct direct_node *n = &dev->direct[id];
+	struct input_absinfo abs;
+	unsigned int code;
+
+	for (code = direct_codes[id][0]; code <= direct_codes[id][1]; ++code) {
+		if (!ioctl(n->fd, EVIOCGABS(code), &abs))
+			direct_set(n, id, code, abs.value);
+	}
+}
+
+static void xwiimote_direct_close(struct xwiimote_dev *dev, unsigned int id)
+{
+	struct direct_node *n = &dev->direct[id];
+
+	xf86RemoveInputHandler(n->handler);
+	n->handler = NULL;
+	close(n->fd);
+	n->fd = -1;
+}
+
+static void xwiimote_direct_input(int fd, pointer data)
+{
+	struct xwiimote_dev *dev = data;
+	struct input_event buf[XWIIMOTE_DIRECT_BATCH];
+	struct xwii_event ev;
+	struct direct_node *n;
+	unsigned int id, i, num;
+	ssize_t len;
+
+	for (id = 0; id < DIRECT_NUM; ++id) {
+		if (dev->direct[id].fd == fd)
+			break;
+	}
+	if (id == DIRECT_NUM)
+		return;
+	n = &dev->direct[id];
+
+	for (;;) {
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				xf86IDrvMsg(dev->info, X_INFO, "Lost %s\n",
+					    direct_names[id]);
+				xwiimote_direct_close(dev, id);
+			}
+			return;
+		}
+
+		num = len / sizeof(*buf);
+		XWIIMOTE_PROBE(direct_read, id, num);
+		for (i = 0; i < num; ++i) {
+			if (buf[i].type == EV_ABS) {
+				if (!n->dropped)
+					direct_set(n, id, buf[i].code, buf[i].value);
+			} else if (buf[i].type != EV_SYN) {
+				continue;
+			} else if (buf[i].code == SYN_DROPPED) {
+				n->dropped = true;
+			} else if (buf[i].code == SYN_REPORT && n->dropped) {
+				n->dropped = false;
+				xwiimote_direct_resync(dev, id);
+			} else if (buf[i].code == SYN_REPORT) {
+				/* handlers may modify the event, keep the cache */
+				ev = n->ev;
+				ev.time = buf[i].time;
+				xwiimote_handle(dev, &ev);
+				/* handlers may reconfigure the interfaces */
+				if (n->fd != fd)
+					return;
+			}
+		}
+
+		if (num < XWIIMOTE_DIRECT_BATCH)
+			return;
+	}
+}
+
+/* Take over the event node @fd of the direct node @id. */
+static void xwiimote_direct_open(struct xwiimote_dev *dev, unsigned int id,
+				 int fd)
+{
+	struct direct_node *n = &dev->direct[id];
+	unsigned int i;
+
+	n->fd = fd;
+	memset(&n->ev, 0, sizeof(n->ev));
+	n->dropped = false;
+	if (id == DIRECT_ACCEL) {
+		n->ev.type = XWII_EVENT_ACCEL;
+	} else {
+		n->ev.type = XWII_EVENT_IR;
+		for (i = 0; i < 4; ++i) {
+			n->ev.v.abs[i].x = 1023;
+			n->ev.v.abs[i].y = 1023;
+		}
+	}
+	xwiimote_direct_resync(dev, id);
+
+	n->handler = xf86AddInputHandler(n->fd, xwiimote_direct_input, dev);
+}
+
+/* Close the direct nodes that are not in @want. */
+static void xwiimote_direct_trim(struct xwiimote_dev *dev, unsigned int want)
+{
+	unsigned int id;
+
+	for (id = 0; id < DIRECT_NUM; ++id) {
+		if (!(want & direct_ifaces[id]) && dev->direct[id].fd >= 0)
+			xwiimote_direct_close(dev, id);
+	}
+}
+
+/* wanted interfaces that are opened first, so keys work early */
+#define XWIIMOTE_EARLY_IFACES (XWII_IFACE_CORE | XWII_IFACE_PRO_CONTROLLER)
+#define XWIIMOTE_OPEN_POLL_MS 10
+#define XWIIMOTE_OPEN_RETRY_MS 250
+#define XWIIMOTE_OPEN_RETRIES 5
+
+static unsigned int xwiimote_wanted_ifs(struct xwiimote_dev *dev)
+{
+	return xwiimote_active_ifs(dev) & xwii_iface_available(dev->iface);
+}
+
+static unsigned int xwiimote_opened_ifs(struct xwiimote_dev *dev)
+{
+	unsigned int id, opened;
+
+	opened = xwii_iface_opened(dev->iface);
+	for (id = 0; id < DIRECT_NUM; ++id) {
+		if (dev->direct[id].fd >= 0)
+			opened |= direct_ifaces[id];
+	}
+
+	return opened;
+}
+
+static const struct {
+	unsigned int iface;
+	const char *name;
+} iface_names[] = {
+	{ XWII_IFACE_CORE, XWII_NAME_CORE },
+	{ XWII_IFACE_ACCEL, XWII_NAME_ACCEL },
+	{ XWII_IFACE_IR, XWII_NAME_IR },
+	{ XWII_IFACE_MOTION_PLUS, XWII_NAME_MOTION_PLUS },
+	{ XWII_IFACE_NUNCHUK, XWII_NAME_NUNCHUK },
+	{ XWII_IFACE_CLASSIC_CONTROLLER, XWII_NAME_CLASSIC_CONTROLLER },
+	{ XWII_IFACE_BALANCE_BOARD, XWII_NAME_BALANCE_BOARD },
+	{ XWII_IFACE_PRO_CONTROLLER, XWII_NAME_PRO_CONTROLLER },
+	{ 0, NULL },
+};
+
+/*
+ * A worker thread opens the event node of one interface. The kernel driver
+ * talks to the remote on the first open of a node only, which can take long
+ * on a bad link. While the worker holds the node open, opening the interface
+ * again does not block. The job is freed by whoever of the worker and the
+ * device lets go of it last.
+ */
+struct open_job {
+	pthread_mutex_t lock;
+	char *root;
+	const char *name;
+	unsigned int iface;
+	int fd;
+	bool done;
+	bool abandoned;
+};
+
+static void xwiimote_open_job_free(struct open_job *job)
+{
+	pthread_mutex_destroy(&job->lock);
+	free(job->root);
+	free(job);
+}
+
+static void *xwiimote_open_worker(void *arg)
+{
+	struct open_job *job = arg;
+	bool abandoned;
+	char *path;
+	int fd;
+
+	path = xwiimote_direct_path(job->root, job->name);
+	if (!path) {
+		fd = -ENODEV;
+	} else {
+		fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			fd = -errno;
+		free(path);
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->fd = fd;
+	job->done = true;
+	abandoned = job->abandoned;
+	pthread_mutex_unlock(&job->lock);
+
+	if (abandoned) {
+		if (fd >= 0)
+			close(fd);
+		xwiimote_open_job_free(job);
+	}
+
+	return NULL;
+}
+
+/* Start opening @iface on a worker thread. Returns 0 or a negative error. */
+static int xwiimote_open_start(struct xwiimote_dev *dev, unsigned int iface)
+{
+	struct open_job *job;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; iface_names[i].name; ++i) {
+		if (iface_names[i].iface == iface)
+			break;
+	}
+	if (!iface_names[i].name)
+		return -EINVAL;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->root = strdup(dev->root);
+	if (!job->root) {
+		free(job);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&job->lock, NULL);
+	job->name = iface_names[i].name;
+	job->iface = iface;
+	job->fd = -1;
+
+	/* signals are for the server threads, not for the worker */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, xwiimote_open_worker, job);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		xwiimote_open_job_free(job);
+		return -ret;
+	}
+
+	dev->open_job = job;
+	return 0;
+}
+
+/*
+ * Take the result of the running job. Returns false if it is still running,
+ * otherwise stores the fd or negative error in @fd and frees the job.
+ */
+static bool xwiimote_open_finish(struct xwiimote_dev *dev, unsigned int *iface,
+				 int *fd)
+{
+	struct open_job *job = dev->open_job;
+	bool done;
+
+	pthread_mutex_lock(&job->lock);
+	done = job->done;
+	pthread_mutex_unlock(&job->lock);
+	if (!done)
+		return false;
+
+	*iface = job->iface;
+	*fd = job->fd;
+	xwiimote_open_job_free(job);
+	dev->open_job = NULL;
+	return true;
+}
+
+/* Drop the running job, the worker closes its fd once the open returns. */
+static void xwiimote_open_cancel(struct xwiimote_dev *dev)
+{
+	struct open_job *job = dev->open_job;
+	bool done;
+
+	if (!job)
+		return;
+
+	pthread_mutex_lock(&job->lock);
+	done = job->done;
+	job->abandoned = true;
+	pthread_mutex_unlock(&job->lock);
+
+	if (done) {
+		if (job->fd >= 0)
+			close(job->fd);
+		xwiimote_open_job_free(job);
+	}
+	dev->open_job = NULL;
+}
+
+/* Open @iface with the event node @fd opened by xwiimote_open_worker(). */
+static int xwiimote_open_iface(struct xwiimote_dev *dev, unsigned int iface,
+			       int fd)
+{
+	unsigned int id;
+	int ret;
+
+	for (id = 0; id < DIRECT_NUM; ++id) {
+		if (iface == direct_ifaces[id] && (iface & dev->direct_ifs)) {
+			xwiimote_direct_open(dev, id, fd);
+			return 0;
+		}
+	}
+
+	ret = xwii_iface_open(dev->iface, iface);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Opening an interface waits for the remote to acknowledge, which can take
+ * long on a bad link. Interfaces are thus opened one at a time on a worker
+ * thread, see struct open_job, and this timer polls for the result, so
+ * neither the server nor other devices are held up and the device works with
+ * whatever is open so far. The interfaces that make the keys work are opened
+ * first. Failed opens are retried with backoff.
+ */
+static CARD32 xwiimote_open_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	struct xwiimote_dev *dev = arg;
+	unsigned int missing, iface;
+	struct timeval tv;
+	int sigstate, ret, fd;
+	CARD32 next = 0;
+
+	sigstate = xwiimote_input_lock();
+
+	if (dev->info->fd < 0) {
+		xwiimote_open_cancel(dev);
+		goto out_unlock;
+	}
+
+	if (dev->open_job) {
+		if (!xwiimote_open_finish(dev, &iface, &fd)) {
+			next = XWIIMOTE_OPEN_POLL_MS;
+			goto out_unlock;
+		}
+
+		/* the device may have been reconfigured meanwhile */
+		missing = xwiimote_wanted_ifs(dev) & ~xwiimote_opened_ifs(dev);
+		missing &= ~dev->open_failed;
+		if (!(missing & iface)) {
+			if (fd >= 0)
+				close(fd);
+		} else {
+			ret = fd < 0 ? fd : xwiimote_open_iface(dev, iface, fd);
+			if (!ret) {
+				dev->open_retries = 0;
+			} else if (++dev->open_retries > XWIIMOTE_OPEN_RETRIES) {
+				xf86IDrvMsg(dev->info, X_INFO,
+					    "Cannot open interface 0x%x: %s\n",
+					    iface, strerror(-ret));
+				dev->open_retries = 0;
+				dev->open_failed |= iface;
+			} else {
+				next = XWIIMOTE_OPEN_RETRY_MS <<
+				       (dev->open_retries - 1);
+				goto out_unlock;
+			}
+		}
+	}
+
+	missing = xwiimote_wanted_ifs(dev) & ~xwiimote_opened_ifs(dev);
+	missing &= ~dev->open_failed;
+	if (missing & XWIIMOTE_EARLY_IFACES)
+		missing &= XWIIMOTE_EARLY_IFACES;
+
+	if (missing) {
+		iface = missing & -missing;
+		ret = xwiimote_open_start(dev, iface);
+		if (ret) {
+			xf86IDrvMsg(dev->info, X_ERROR,
+				    "Cannot start opening interface 0x%x: %s\n",
+				    iface, strerror(-ret));
+			dev->open_failed |= iface;
+			next = 1;
+		} else {
+			next = XWIIMOTE_OPEN_POLL_MS;
+		}
+	} else if (dev->bringup) {
+		gettimeofday(&tv, NULL);
+		xf86IDrvMsg(dev->info, X_INFO, "Bring-up took %lld ms\n",
+			    (long long)timeval_diff_us(&tv, &dev->bringup_start) / 1000);
+		dev->bringup = false;
+	}
+
+out_unlock:
+	xwiimote_input_unlock(sigstate);
+	return next;
+}
+
+/*
+ * Close the interfaces that are no longer needed and schedule opening the
+ * needed ones that are currently available. This is called whenever the
+ * needed set or the available set (on hotplug of extensions) may have
+ * changed, so interfaces are opened lazily once they can be used.
+ */
+static void xwiimote_sync_ifs(struct xwiimote_dev *dev)
+{
+	unsigned int want, opened;
+
+	want = xwiimote_wanted_ifs(dev);
+	opened = xwii_iface_opened(dev->iface);
+
+	if (opened & ~(want & ~dev->direct_ifs))
+		xwii_iface_close(dev->iface, opened & ~(want & ~dev->direct_ifs));
+	xwiimote_direct_trim(dev, want & dev->direct_ifs);
+
+	/* retry failed interfaces once they are needed again */
+	dev->open_failed &= want;
+	if (want & ~xwiimote_opened_ifs(dev) & ~dev->open_failed)
+		dev->open_timer = TimerSet(dev->open_timer, 0, 1,
+					   xwiimote_open_timer, dev);
+}
+
+static int xwiimote_set_property(DeviceIntPtr device, Atom atom,
+				 XIPropertyValuePtr val, BOOL checkonly)
+{
+	InputInfoPtr info = device->public.devicePrivate;
+	struct xwiimote_dev *dev = info->private;
+	int sigstate;
+
+	if (atom == dev->idle_prop)
+		return BadAccess;
+
+	if (atom == dev->rec_prop) {
+		if (val->format != 8 || val->size != 1 ||
+		    val->type != XA_INTEGER)
+			return BadMatch;
+
+		if (!checkonly) {
+			sigstate = xwiimote_input_lock();
+			dev->rec_on = *(uint8_t*)val->data;
+			xwiimote_input_unlock(sigstate);
+		}
+	}
+
+	if (atom == dev->gestures_prop) {
+		if (val->format != 8 || val->size != 1 ||
+		    val->type != XA_INTEGER)
+			return BadMatch;
+
+		if (!checkonly) {
+			sigstate = xwiimote_input_lock();
+			dev->gestures = *(uint8_t*)val->data;
+			dev->gesture_grav_valid = false;
+			xwiimote_update_ifs(dev);
+			if (device->public.on)
+				xwiimote_sync_ifs(dev);
+			xwiimote_input_unlock(sigstate);
+		}
+	}
+
+	return Success;
+}
+
+static void xwiimote_init_properties(struct xwiimote_dev *dev,
+				     DeviceIntPtr device)
+{
+	uint8_t val = 0;
+
+	if (dev->idle_timeout_secs) {
+		dev->idle_prop = MakeAtom(XWIIMOTE_PROP_IDLE,
+					  strlen(XWIIMOTE_PROP_IDLE), TRUE);
+		XIChangeDeviceProperty(device, dev->idle_prop, XA_INTEGER, 8,
+				       PropModeReplace, 1, &val, FALSE);
+		XISetDevicePropertyDeletable(device, dev->idle_prop, FALSE);
+	}
+
+	if (dev->gestures_mapped) {
+		val = dev->gestures;
+		dev->gestures_prop = MakeAtom(XWIIMOTE_PROP_GESTURES,
+					      strlen(XWIIMOTE_PROP_GESTURES),
+					      TRUE);
+		XIChangeDeviceProperty(device, dev->gestures_prop, XA_INTEGER,
+				       8, PropModeReplace, 1, &val, FALSE);
+		XISetDevicePropertyDeletable(device, dev->gestures_prop, FALSE);
+	}
+
+	if (dev->rec) {
+		val = dev->rec_on;
+		dev->rec_prop = MakeAtom(XWIIMOTE_PROP_RECORD,
+					 strlen(XWIIMOTE_PROP_RECORD), TRUE);
+		XIChangeDeviceProperty(device, dev->rec_prop, XA_INTEGER, 8,
+				       PropModeReplace, 1, &val, FALSE);
+		XISetDevicePropertyDeletable(device, dev->rec_prop, FALSE);
+	}
+
+	XIRegisterPropertyHandler(device, xwiimote_set_property, NULL, NULL);
+}
+
+static int xwiimote_init(struct xwiimote_dev *dev, DeviceIntPtr device)
+{
+	int ret;
+
+	ret = xwiimote_prepare_key(dev, device);
+	if (ret != Success)
+		return ret;
 
 	ret = xwiimote_prepare_btn(dev, device);
 	if (ret != Success)
@@ -347,38 +2172,721 @@ static int xwiimote_init(struct xwiimote_dev *dev, DeviceIntPtr device)
 
 	switch(dev->motion_source) {
 	case SOURCE_ACCEL:
-		ret = xwiimote_prepare_abs(dev, device, -100, 100, -100, 100);
+		if (dev->accel_mode == ACCEL_JOYSTICK)
+			ret = xwiimote_prepare_rel(dev, device, -10000, 10000, -10000, 10000);
+		else if (dev->accel_mode == ACCEL_TILT)
+			ret = xwiimote_prepare_abs(dev, device,
+						   -XWIIMOTE_ACCEL_TILT_RES,
+						   XWIIMOTE_ACCEL_TILT_RES,
+						   -XWIIMOTE_ACCEL_TILT_RES,
+						   XWIIMOTE_ACCEL_TILT_RES);
+		else
+			ret = xwiimote_prepare_abs(dev, device, -100, 100, -100, 100);
 		break;
 	case SOURCE_MOTIONPLUS:
+	case SOURCE_NUNCHUK:
+	case SOURCE_CONTROLLER:
+	case SOURCE_BOARD:
 		ret = xwiimote_prepare_rel(dev, device, -10000, 10000, -10000, 10000);
 		break;
 	case SOURCE_IR:
 		ret = xwiimote_prepare_abs(dev, device, 0, 1023, 0, 767);
 		break;
 	default:
-		ret = Success;
+		/* raw valuators need a valuator class even without motion */
+		if (dev->raw_used)
+			ret = xwiimote_prepare_rel(dev, device, -10000, 10000, -10000, 10000);
+		else
+			ret = Success;
 		break;
 	}
 
 	if (ret != Success)
 		return ret;
 
+	xwiimote_init_properties(dev, device);
+
 	return Success;
 }
 
 static int xwiimote_close(struct xwiimote_dev *dev, DeviceIntPtr device)
 {
+	valuator_mask_free(&dev->scroll_vals);
+	valuator_mask_free(&dev->raw_vals);
 	return Success;
 }
 
-static void xwiimote_key(struct xwiimote_dev *dev, struct xwii_event *ev)
+/*
+ * The recorder keeps the last records in a ring inside a mapped file, so the
+ * trace survives a server crash and can be read while the server runs. The
+ * input lock serializes all writers; readers take the records before head.
+ */
+static struct rec_record *xwiimote_rec_next(struct xwiimote_dev *dev,
+					    uint32_t kind)
+{
+	struct rec_record *r;
+
+	r = &dev->rec_records[dev->rec->head & (dev->rec->capacity - 1)];
+	r->kind = kind;
+	return r;
+}
+
+static void xwiimote_rec_commit(struct xwiimote_dev *dev)
+{
+	__atomic_store_n(&dev->rec->head, dev->rec->head + 1,
+			 __ATOMIC_RELEASE);
+}
+
+static void xwiimote_rec_input(struct xwiimote_dev *dev,
+			       const struct xwii_event *ev)
+{
+	struct rec_record *r;
+	size_t len;
+
+	r = xwiimote_rec_next(dev, REC_INPUT);
+	r->sec = ev->time.tv_sec;
+	r->usec = ev->time.tv_usec;
+	r->type = ev->type;
+	len = sizeof(ev->v) < sizeof(r->u.data) ? sizeof(ev->v) :
+						  sizeof(r->u.data);
+	memcpy(r->u.data, &ev->v, len);
+	xwiimote_rec_commit(dev);
+}
+
+static void xwiimote_rec_output(struct xwiimote_dev *dev, uint32_t kind,
+				int32_t a, int32_t b, int32_t c)
+{
+	struct rec_record *r;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	r = xwiimote_rec_next(dev, kind);
+	r->sec = tv.tv_sec;
+	r->usec = tv.tv_usec;
+	r->type = 0;
+	r->u.val[0] = a;
+	r->u.val[1] = b;
+	r->u.val[2] = c;
+	xwiimote_rec_commit(dev);
+}
+
+static void xwiimote_rec_open(struct xwiimote_dev *dev, const char *dir,
+			      unsigned int capacity)
+{
+	char path[PATH_MAX];
+	size_t size;
+	void *map;
+	int fd, ret;
+
+	if (dev->uniq)
+		ret = snprintf(path, sizeof(path), "%s/xwiimote-%s.rec", dir,
+			       dev->uniq);
+	else
+		ret = snprintf(path, sizeof(path), "%s/xwiimote-%d.rec", dir,
+			       dev->dev_id);
+	if (ret < 0 || ret >= (int)sizeof(path))
+		return;
+
+	size = sizeof(*dev->rec) + (size_t)capacity * sizeof(struct rec_record);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || ftruncate(fd, size)) {
+		xf86IDrvMsg(dev->info, X_ERROR, "Cannot create %s: %s\n",
+			    path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		xf86IDrvMsg(dev->info, X_ERROR, "Cannot map %s: %s\n",
+			    path, strerror(errno));
+		return;
+	}
+
+	dev->rec = map;
+	dev->rec_records = (struct rec_record*)(dev->rec + 1);
+	dev->rec_size = size;
+	memcpy(dev->rec->magic, XWIIMOTE_REC_MAGIC, sizeof(dev->rec->magic));
+	dev->rec->version = XWIIMOTE_REC_VERSION;
+	dev->rec->record_size = sizeof(struct rec_record);
+	dev->rec->capacity = capacity;
+	dev->rec->head = 0;
+
+	xf86IDrvMsg(dev->info, X_INFO, "Recording to %s\n", path);
+}
+
+static void xwiimote_rec_close(struct xwiimote_dev *dev)
+{
+	if (!dev->rec)
+		return;
+
+	dev->rec_on = false;
+	munmap(dev->rec, dev->rec_size);
+	dev->rec = NULL;
+	dev->rec_records = NULL;
+}
+
+static void xwiimote_post_scroll(struct xwiimote_dev *dev, double dx,
+				 double dy)
+{
+	valuator_mask_zero(dev->scroll_vals);
+	if (dx)
+		valuator_mask_set_double(dev->scroll_vals, dev->scroll_axis, dx);
+	if (dy)
+		valuator_mask_set_double(dev->scroll_vals, dev->scroll_axis + 1,
+					 dy);
+	XWIIMOTE_PROBE(post_scroll, (int)(dx * 1000), (int)(dy * 1000));
+	if (dev->rec_on)
+		xwiimote_rec_output(dev, REC_SCROLL, dx * 1000, dy * 1000, 0);
+	xf86PostMotionEventM(dev->info->dev, Relative, dev->scroll_vals);
+}
+
+/*
+ * While a scroll button is held, motion of any source is turned into smooth
+ * scroll events. The scroll speed is tracked for kinetic scrolling.
+ */
+static void xwiimote_scroll_motion(struct xwiimote_dev *dev,
+				   const struct timeval *time,
+				   int absolute, int x, int y)
+{
+	double dt;
+	int dx, dy;
+
+	if (absolute) {
+		dx = x - dev->scroll_last_x;
+		dy = y - dev->scroll_last_y;
+		dev->scroll_last_x = x;
+		dev->scroll_last_y = y;
+		if (!dev->scroll_last_valid) {
+			dev->scroll_last_valid = true;
+			return;
+		}
+	} else {
+		dx = x;
+		dy = y;
+	}
+
+	dt = timeval_diff_us(time, &dev->scroll_last_time) / 1000.0;
+	dev->scroll_last_time = *time;
+	if (dt > 0 && dt < XWIIMOTE_RATE_MAX_GAP_US / 1000) {
+		dev->scroll_vel[0] = dev->scroll_vel[0] * 0.7 + dx / dt * 0.3;
+		dev->scroll_vel[1] = dev->scroll_vel[1] * 0.7 + dy / dt * 0.3;
+	}
+
+	if (dx || dy)
+		xwiimote_post_scroll(dev, dx, dy);
+}
+
+/* Kinetic scrolling: keep scrolling with exponentially decaying speed */
+static CARD32 xwiimote_scroll_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	struct xwiimote_dev *dev = arg;
+	double dt, decay;
+	int sigstate;
+	CARD32 next = XWIIMOTE_SCROLL_FRAME_MS;
+
+	sigstate = xwiimote_input_lock();
+
+	dt = (CARD32)(now - dev->scroll_kinetic_last);
+	dev->scroll_kinetic_last = now;
+
+	decay = exp(-dt / dev->scroll_decay_ms);
+	dev->scroll_vel[0] *= decay;
+	dev->scroll_vel[1] *= decay;
+
+	if (fabs(dev->scroll_vel[0]) < XWIIMOTE_SCROLL_MIN_VEL &&
+	    fabs(dev->scroll_vel[1]) < XWIIMOTE_SCROLL_MIN_VEL)
+		next = 0;
+	else
+		xwiimote_post_scroll(dev, dev->scroll_vel[0] * dt,
+				     dev->scroll_vel[1] * dt);
+
+	xwiimote_input_unlock(sigstate);
+	return next;
+}
+
+static void xwiimote_scroll(struct xwiimote_dev *dev,
+			    const struct timeval *time, unsigned int state)
+{
+	if (dev->scroll_axis < 0)
+		return;
+
+	if (state) {
+		if (!dev->scroll_held++) {
+			TimerCancel(dev->scroll_timer);
+			dev->scroll_last_valid = false;
+			dev->scroll_last_time = *time;
+			dev->scroll_vel[0] = 0;
+			dev->scroll_vel[1] = 0;
+		}
+	} else if (dev->scroll_held && !--dev->scroll_held) {
+		if (!dev->scroll_decay_ms)
+			return;
+		if (fabs(dev->scroll_vel[0]) < XWIIMOTE_SCROLL_MIN_VEL &&
+		    fabs(dev->scroll_vel[1]) < XWIIMOTE_SCROLL_MIN_VEL)
+			return;
+
+		dev->scroll_kinetic_last = GetTimeInMillis();
+		dev->scroll_timer = TimerSet(dev->scroll_timer, 0,
+					     XWIIMOTE_SCROLL_FRAME_MS,
+					     xwiimote_scroll_timer, dev);
+	}
+}
+
+static void xwiimote_raw_set(struct xwiimote_dev *dev, unsigned int id,
+			     int32_t v)
+{
+	if (dev->raw_axis[id] < 0 || dev->raw_cur[id] == v)
+		return;
+
+	dev->raw_cur[id] = v;
+	dev->raw_changed |= 1U << id;
+}
+
+/*
+ * Add the changed raw axes to @mask. Relative events are accumulated by the
+ * server on all axes, so they carry the difference to the last posted value.
+ */
+static void xwiimote_raw_fill(struct xwiimote_dev *dev, ValuatorMask *mask,
+			      int absolute)
+{
+	unsigned int i;
+	int32_t v;
+
+	for (i = 0; i < RAW_NUM; ++i) {
+		if (!(dev->raw_changed & (1U << i)))
+			continue;
+
+		v = dev->raw_cur[i];
+		if (!absolute)
+			v -= dev->raw_posted[i];
+		valuator_mask_set(mask, dev->raw_axis[i], v);
+		dev->raw_posted[i] = dev->raw_cur[i];
+	}
+
+	dev->raw_changed = 0;
+}
+
+/* Raw data that was not sent along with pointer motion */
+static void xwiimote_post_raw(struct xwiimote_dev *dev)
+{
+	int absolute = dev->motion == MOTION_ABS;
+
+	valuator_mask_zero(dev->raw_vals);
+	xwiimote_raw_fill(dev, dev->raw_vals, absolute);
+	XWIIMOTE_PROBE(post_raw, absolute);
+	if (dev->rec_on)
+		xwiimote_rec_output(dev, REC_RAW, absolute, 0, 0);
+	xf86PostMotionEventM(dev->info->dev, absolute, dev->raw_vals);
+}
+
+static void xwiimote_post_xy(struct xwiimote_dev *dev, int absolute,
+			     int x, int y)
+{
+	XWIIMOTE_PROBE(post_motion, absolute, x, y);
+	if (dev->rec_on)
+		xwiimote_rec_output(dev, REC_MOTION, absolute, x, y);
+
+	if (!dev->raw_changed) {
+		xf86PostMotionEvent(dev->info->dev, absolute, 0, 2, x, y);
+		return;
+	}
+
+	valuator_mask_zero(dev->raw_vals);
+	valuator_mask_set(dev->raw_vals, 0, x);
+	valuator_mask_set(dev->raw_vals, 1, y);
+	xwiimote_raw_fill(dev, dev->raw_vals, absolute);
+	xf86PostMotionEventM(dev->info->dev, absolute, dev->raw_vals);
+}
+
+static void xwiimote_flush_motion(struct xwiimote_dev *dev)
+{
+	if (!dev->motion_pending)
+		return;
+
+	dev->motion_pending = false;
+	xwiimote_post_xy(dev, dev->motion_pending_abs,
+			 dev->motion_pending_x, dev->motion_pending_y);
+}
+
+static CARD32 xwiimote_motion_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	struct xwiimote_dev *dev = arg;
+	int sigstate;
+	CARD32 next = dev->motion_frame_ms;
+
+	sigstate = xwiimote_input_lock();
+
+	if (dev->motion_pending) {
+		xwiimote_flush_motion(dev);
+	} else {
+		dev->motion_timer_armed = false;
+		next = 0;
+	}
+
+	xwiimote_input_unlock(sigstate);
+	return next;
+}
+
+/*
+ * Remotes report much faster than most displays refresh. If MotionFrameMs is
+ * set, only the latest position (or the summed relative motion) is posted
+ * once per frame. The first motion after a quiet period is posted right away
+ * so pacing adds no latency to the start of a movement.
+ */
+static void xwiimote_emit_motion(struct xwiimote_dev *dev, int absolute,
+				 int x, int y)
+{
+	if (!dev->motion_frame_ms) {
+		xwiimote_post_xy(dev, absolute, x, y);
+		return;
+	}
+
+	if (dev->motion_pending && dev->motion_pending_abs != absolute)
+		xwiimote_flush_motion(dev);
+
+	if (absolute || !dev->motion_pending) {
+		dev->motion_pending_x = x;
+		dev->motion_pending_y = y;
+	} else {
+		dev->motion_pending_x += x;
+		dev->motion_pending_y += y;
+	}
+	dev->motion_pending_abs = absolute;
+	dev->motion_pending = true;
+
+	if (!dev->motion_timer_armed) {
+		xwiimote_flush_motion(dev);
+		dev->motion_timer_armed = true;
+		dev->motion_timer = TimerSet(dev->motion_timer, 0,
+					     dev->motion_frame_ms,
+					     xwiimote_motion_timer, dev);
+	}
+}
+
+static void xwiimote_post_motion(struct xwiimote_dev *dev,
+				 const struct timeval *time,
+				 int absolute, int x, int y)
+{
+	struct motion_sample *h;
+
+	if (dev->precision_held) {
+		if (absolute) {
+			x = dev->precision_anchor_x +
+			    (x - dev->precision_anchor_x) *
+			    dev->precision_gain / 100;
+			y = dev->precision_anchor_y +
+			    (y - dev->precision_anchor_y) *
+			    dev->precision_gain / 100;
+		} else {
+			dev->precision_rem[0] += x * dev->precision_gain / 100.0;
+			dev->precision_rem[1] += y * dev->precision_gain / 100.0;
+			x = dev->precision_rem[0];
+			y = dev->precision_rem[1];
+			dev->precision_rem[0] -= x;
+			dev->precision_rem[1] -= y;
+			if (!x && !y)
+				return;
+		}
+	}
+
+	if (dev->scroll_held) {
+		xwiimote_scroll_motion(dev, time, absolute, x, y);
+		return;
+	}
+
+	if (absolute) {
+		++dev->motion_history_cur;
+		dev->motion_history_cur %= XWIIMOTE_MOTION_HISTORY_NUM;
+		h = &dev->motion_history[dev->motion_history_cur];
+		h->time = *time;
+		h->x = x;
+		h->y = y;
+	}
+
+	/* pointer is held still around button presses */
+	if (timeval_diff_us(time, &dev->click_lock_until) < 0)
+		return;
+
+	xwiimote_emit_motion(dev, absolute, x, y);
+}
+
+/*
+ * A button press physically moves the remote. Move the pointer back to where
+ * it was shortly before the press and hold it there for the click-lock
+ * window, so clicks and double-clicks land where the user aimed.
+ */
+static void xwiimote_click_lock(struct xwiimote_dev *dev,
+				const struct timeval *time,
+				unsigned int state, int absolute)
+{
+	struct motion_sample *h, *last, *pick = NULL;
+	int64_t lookback, d;
+	int i, idx;
+
+	if (!dev->click_lock_ms)
+		return;
+
+	if (absolute && state) {
+		lookback = dev->click_lock_lookback_ms * 1000;
+		last = &dev->motion_history[dev->motion_history_cur];
+		for (i = 0; i < XWIIMOTE_MOTION_HISTORY_NUM; ++i) {
+			idx = dev->motion_history_cur - i;
+			if (idx < 0)
+				idx += XWIIMOTE_MOTION_HISTORY_NUM;
+			h = &dev->motion_history[idx];
+			if (!h->time.tv_sec && !h->time.tv_usec)
+				break;
+			d = timeval_diff_us(time, &h->time);
+			pick = h;
+			if (d >= lookback)
+				break;
+		}
+
+		if (pick && pick != last) {
+			XWIIMOTE_PROBE(post_motion, absolute, pick->x, pick->y);
+			if (dev->rec_on)
+				xwiimote_rec_output(dev, REC_MOTION, absolute,
+						    pick->x, pick->y);
+			xf86PostMotionEvent(dev->info->dev, absolute, 0, 2,
+					    pick->x, pick->y);
+		}
+	}
+
+	dev->click_lock_until = *time;
+	dev->click_lock_until.tv_usec += dev->click_lock_ms * 1000;
+	dev->click_lock_until.tv_sec += dev->click_lock_until.tv_usec / 1000000;
+	dev->click_lock_until.tv_usec %= 1000000;
+}
+
+/*
+ * IR and accelerometer tilt smooth their output already, the other motion
+ * paths pass their values through this low-pass while a precision modifier
+ * is held. It uses the same weighting as the IR averaging. Slots 0 and 1 are
+ * the X and Y axes of the motion source, 2 and 3 those of the sticks.
+ */
+static double xwiimote_precision_smooth(struct xwiimote_dev *dev,
+					unsigned int slot, double v)
+{
+	double *f = &dev->precision_filt[slot];
+	int weight = dev->precision_smoothing - 1;
+
+	if (!dev->precision_held)
+		return v;
+
+	if (!(dev->precision_filt_valid & (1 << slot))) {
+		dev->precision_filt_valid |= 1 << slot;
+		*f = v;
+	} else {
+		*f = (v + *f * weight) / (weight + 1);
+	}
+
+	return *f;
+}
+
+/*
+ * While a precision modifier is held, absolute motion is scaled around the
+ * position the pointer had when the modifier was pressed.
+ */
+static void xwiimote_precision(struct xwiimote_dev *dev, unsigned int state)
+{
+	struct motion_sample *h;
+
+	if (state) {
+		if (!dev->precision_held++) {
+			h = &dev->motion_history[dev->motion_history_cur];
+			dev->precision_anchor_x = h->x;
+			dev->precision_anchor_y = h->y;
+			dev->precision_rem[0] = 0;
+			dev->precision_rem[1] = 0;
+			dev->precision_filt_valid = 0;
+		}
+	} else if (dev->precision_held) {
+		--dev->precision_held;
+	}
+}
+
+static void xwiimote_func(struct xwiimote_dev *dev,
+			  const struct timeval *time,
+			  const struct func *func, unsigned int state)
 {
-	unsigned int code;
-	unsigned int state;
 	unsigned int key;
 	int btn;
 	int absolute = 0;
-	enum keyset keyset = KEYSET_NORMAL;
+
+	if (dev->motion == MOTION_ABS)
+		absolute = 1;
+
+	switch (func->type) {
+		case FUNC_BTN:
+			btn = func->u.btn;
+			xwiimote_flush_motion(dev);
+			xwiimote_click_lock(dev, time, state, absolute);
+			XWIIMOTE_PROBE(post_button, btn, state);
+			if (dev->rec_on)
+				xwiimote_rec_output(dev, REC_BUTTON, absolute,
+						    btn, state);
+			xf86PostButtonEvent(dev->info->dev, absolute, btn,
+								state, 0, 0);
+			break;
+		case FUNC_KEY:
+			key = func->u.key + MIN_KEYCODE;
+			xwiimote_flush_motion(dev);
+			XWIIMOTE_PROBE(post_key, key, state);
+			if (dev->rec_on)
+				xwiimote_rec_output(dev, REC_KEY, key, state, 0);
+			xf86PostKeyboardEvent(dev->info->dev, key, state);
+			break;
+		case FUNC_PRECISION:
+			xwiimote_precision(dev, state);
+			break;
+		case FUNC_SCROLL:
+			xwiimote_scroll(dev, time, state);
+			break;
+		case FUNC_IGNORE:
+			/* fallthrough */
+		default:
+			break;
+	}
+}
+
+/*
+ * The pending button was held for the whole resolve time, or another button
+ * was pressed meanwhile. Either way it is no tap, so fire its hold or
+ * long-press function, or its plain function if it only waited for a chord.
+ */
+static void xwiimote_key_resolve(struct xwiimote_dev *dev,
+				 const struct timeval *time)
+{
+	int code = dev->key_pending;
+	struct func *f;
+
+	if (code < 0)
+		return;
+
+	dev->key_pending = -1;
+	TimerCancel(dev->key_timer);
+
+	if (dev->map_hold[code].type != FUNC_IGNORE) {
+		dev->key_state[code] = KEY_STATE_HOLD;
+		xwiimote_func(dev, time, &dev->map_hold[code], 1);
+	} else if (dev->map_long[code].type != FUNC_IGNORE) {
+		dev->key_state[code] = KEY_STATE_LONG;
+		xwiimote_func(dev, time, &dev->map_long[code], 1);
+		xwiimote_func(dev, time, &dev->map_long[code], 0);
+	} else {
+		dev->key_state[code] = KEY_STATE_NORMAL;
+		f = &dev->map_key[dev->key_pressed[code]][code];
+		xwiimote_func(dev, time, f, 1);
+	}
+}
+
+static CARD32 xwiimote_key_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	struct xwiimote_dev *dev = arg;
+	struct timeval time;
+	int sigstate;
+
+	sigstate = xwiimote_input_lock();
+
+	/* use the nominal expiry time, it is on the same clock as the events */
+	time = dev->key_pending_time;
+	time.tv_usec += dev->key_resolve_ms * 1000;
+	time.tv_sec += time.tv_usec / 1000000;
+	time.tv_usec %= 1000000;
+	xwiimote_key_resolve(dev, &time);
+
+	xwiimote_input_unlock(sigstate);
+	return 0;
+}
+
+static int xwiimote_find_chord(struct xwiimote_dev *dev, unsigned int a,
+			       unsigned int b)
+{
+	unsigned int i;
+	struct key_chord *c;
+
+	for (i = 0; i < XWIIMOTE_CHORD_NUM; ++i) {
+		c = &dev->chords[i];
+		if (c->a == c->b)
+			continue;
+		if ((c->a == a && c->b == b) || (c->a == b && c->b == a))
+			return i;
+	}
+
+	return -1;
+}
+
+static void xwiimote_key_deferred(struct xwiimote_dev *dev,
+				  const struct timeval *time,
+				  unsigned int code, unsigned int state)
+{
+	struct func *f = &dev->map_key[dev->key_pressed[code]][code];
+	struct key_chord *c;
+	unsigned int other;
+	int chord;
+
+	if (state) {
+		if (dev->key_pending >= 0) {
+			chord = xwiimote_find_chord(dev, dev->key_pending, code);
+			if (chord >= 0) {
+				TimerCancel(dev->key_timer);
+				dev->key_state[dev->key_pending] = KEY_STATE_CHORD;
+				dev->key_state[code] = KEY_STATE_CHORD;
+				dev->key_chord[dev->key_pending] = chord;
+				dev->key_chord[code] = chord;
+				dev->key_pending = -1;
+				xwiimote_func(dev, time, &dev->chords[chord].func, 1);
+				return;
+			}
+
+			xwiimote_key_resolve(dev, time);
+		}
+
+		dev->key_pending = code;
+		dev->key_pending_time = *time;
+		dev->key_state[code] = KEY_STATE_PENDING;
+		dev->key_timer = TimerSet(dev->key_timer, 0, dev->key_resolve_ms,
+					  xwiimote_key_timer, dev);
+		return;
+	}
+
+	switch (dev->key_state[code]) {
+	case KEY_STATE_PENDING:
+		/* released within the resolve time: a plain tap */
+		dev->key_pending = -1;
+		TimerCancel(dev->key_timer);
+		xwiimote_func(dev, time, f, 1);
+		xwiimote_func(dev, time, f, 0);
+		break;
+	case KEY_STATE_NORMAL:
+		xwiimote_func(dev, time, f, 0);
+		break;
+	case KEY_STATE_HOLD:
+		xwiimote_func(dev, time, &dev->map_hold[code], 0);
+		break;
+	case KEY_STATE_CHORD:
+		/* the first released button ends the chord */
+		c = &dev->chords[dev->key_chord[code]];
+		other = c->a == code ? c->b : c->a;
+		if (dev->key_state[other] == KEY_STATE_CHORD)
+			dev->key_state[other] = KEY_STATE_SWALLOW;
+		xwiimote_func(dev, time, &c->func, 0);
+		break;
+	default:
+		break;
+	}
+
+	dev->key_state[code] = KEY_STATE_UP;
+}
+
+static void xwiimote_key(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	unsigned int code;
+	unsigned int state;
+	unsigned int layer, mask;
 
 	code = ev->v.key.code;
 	state = ev->v.key.state;
@@ -387,78 +2895,374 @@ static void xwiimote_key(struct xwiimote_dev *dev, struct xwii_event *ev)
 	if (state > 1)
 		return;
 
-	if (dev->motion == MOTION_ABS)
-		absolute = 1;
-
 	if (ev->v.key.state) {
+		dev->layer_state |= dev->layer_key_mask[code];
+		mask = dev->layer_state;
 		if (ev->time.tv_sec < dev->ir_last_valid_event.tv_sec + dev->ir_keymap_expiry_secs
 				|| (ev->time.tv_sec == dev->ir_last_valid_event.tv_sec + dev->ir_keymap_expiry_secs
 					&& ev->time.tv_usec < dev->ir_last_valid_event.tv_usec)) {
-			keyset = KEYSET_IR;
+			mask |= dev->layer_ir_mask;
 		}
-		dev->key_pressed[code] = keyset;
+		layer = dev->layer_table[mask];
+		dev->key_pressed[code] = layer;
+	} else {
+		dev->layer_state &= ~dev->layer_key_mask[code];
+		layer = dev->key_pressed[code];
+	}
+
+	if (dev->key_deferred[code]) {
+		xwiimote_key_deferred(dev, &ev->time, code, state);
+		return;
+	}
+
+	/* any other press decides a pending button as held */
+	if (state)
+		xwiimote_key_resolve(dev, &ev->time);
+
+	xwiimote_func(dev, &ev->time, &dev->map_key[layer][code], state);
+}
+
+static int32_t median3(int32_t a, int32_t b, int32_t c)
+{
+	if (a > b) {
+		if (b > c)
+			return b;
+		return a > c ? c : a;
 	} else {
-		keyset = dev->key_pressed[code];
+		if (a > c)
+			return a;
+		return b > c ? c : b;
 	}
+}
+
+/*
+ * Move @pos towards @target with a critically damped spring that settles in
+ * roughly @smooth seconds. This is stable for any @dt, so late reports do not
+ * make the pointer overshoot.
+ */
+static void smooth_damp(double *pos, double *vel, double target,
+			double smooth, double dt)
+{
+	double omega, x, e, change, tmp;
+
+	omega = 2.0 / smooth;
+	x = omega * dt;
+	e = 1.0 / (1.0 + x + 0.48 * x * x + 0.235 * x * x * x);
+	change = *pos - target;
+	tmp = (*vel + omega * change) * dt;
+	*vel = (*vel - omega * tmp) * e;
+	*pos = target + (change + tmp) * e;
+}
+
+/* Tilt angle in degrees of axis @a against the plane of axes @b and @c */
+static double accel_angle(double a, double b, double c)
+{
+	return atan2(a, sqrt(b * b + c * c)) * 180.0 / M_PI;
+}
+
+static double accel_tilt(struct xwiimote_dev *dev, double a, double b,
+			 double c)
+{
+	double angle;
+
+	angle = accel_angle(a, b, c);
+	angle = angle * XWIIMOTE_ACCEL_TILT_RES / dev->accel_tilt_range;
+	if (angle > XWIIMOTE_ACCEL_TILT_RES)
+		angle = XWIIMOTE_ACCEL_TILT_RES;
+	else if (angle < -XWIIMOTE_ACCEL_TILT_RES)
+		angle = -XWIIMOTE_ACCEL_TILT_RES;
+
+	return angle;
+}
+
+/*
+ * Low-lag tilt pointing: a median-of-3 front end removes single-report spikes,
+ * the tilt angles are mapped linearly onto the valuator range and then
+ * smoothed with a critically damped filter. A hysteresis deadband keeps the
+ * pointer still while the remote is held steady.
+ */
+static void accel_median(struct xwiimote_dev *dev, struct xwii_event *ev,
+			 double *x, double *y, double *z)
+{
+	struct xwii_event_abs *m = dev->accel_med;
+
+	dev->accel_med_cur = (dev->accel_med_cur + 1) % 3;
+	m[dev->accel_med_cur] = ev->v.abs[0];
+	if (!dev->accel_med_valid) {
+		m[0] = m[1] = m[2] = ev->v.abs[0];
+		dev->accel_med_valid = true;
+	}
+
+	*x = median3(m[0].x, m[1].x, m[2].x);
+	*y = median3(m[0].y, m[1].y, m[2].y);
+	*z = median3(m[0].z, m[1].z, m[2].z);
+}
+
+static void xwiimote_accel_tilt(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	double x, y, z, target[2], dt, smooth;
+	int i, out[2], absolute;
+
+	accel_median(dev, ev, &x, &y, &z);
+	XWIIMOTE_PROBE(accel_median, (int)x, (int)y, (int)z);
+
+	smooth = dev->accel_smooth_ms / 1000.0;
+	if (dev->precision_held)
+		smooth *= dev->precision_smoothing;
+
+	target[0] = accel_tilt(dev, x, y, z);
+	target[1] = accel_tilt(dev, y, x, z);
+
+	dt = rate_update(&dev->accel_rate, &ev->time) / 1000000.0;
+
+	for (i = 0; i < 2; ++i) {
+		if (!dev->accel_tilt_valid) {
+			dev->accel_pos[i] = target[i];
+			dev->accel_vel[i] = 0;
+			dev->accel_out[i] = target[i];
+		} else {
+			smooth_damp(&dev->accel_pos[i], &dev->accel_vel[i],
+				    target[i], smooth, dt);
+		}
+
+		out[i] = dev->accel_out[i];
+		if (dev->accel_pos[i] > out[i] + dev->accel_deadband)
+			out[i] = dev->accel_pos[i] - dev->accel_deadband;
+		else if (dev->accel_pos[i] < out[i] - dev->accel_deadband)
+			out[i] = dev->accel_pos[i] + dev->accel_deadband;
+	}
+
+	XWIIMOTE_PROBE(accel_tilt, (int)target[0], (int)target[1], out[0],
+		       out[1]);
+	if (dev->accel_tilt_valid &&
+	    out[0] == dev->accel_out[0] && out[1] == dev->accel_out[1])
+		return;
+
+	dev->accel_tilt_valid = true;
+	dev->accel_out[0] = out[0];
+	dev->accel_out[1] = out[1];
+
+	absolute = dev->motion == MOTION_ABS;
+	xwiimote_post_motion(dev, &ev->time, absolute, out[0], out[1]);
+}
+
+/*
+ * Rate control: the tilt angle selects a pointer speed from the precomputed
+ * curve. Fractions of pixels are carried over to the next report so slow
+ * tilts still move the pointer smoothly.
+ */
+static void xwiimote_accel_joystick(struct xwiimote_dev *dev,
+				    struct xwii_event *ev)
+{
+	double x, y, z, angle[2], dt, speed;
+	int i, idx, out[2];
+
+	accel_median(dev, ev, &x, &y, &z);
+	XWIIMOTE_PROBE(accel_median, (int)x, (int)y, (int)z);
+
+	angle[0] = accel_angle(x, y, z);
+	angle[1] = accel_angle(y, x, z);
+
+	dt = rate_update(&dev->accel_rate, &ev->time) / 1000000.0;
+
+	for (i = 0; i < 2; ++i) {
+		idx = fabs(angle[i]) * (XWIIMOTE_ACCEL_JOY_STEPS - 1) / 90.0;
+		speed = dev->accel_joy_lut[idx];
+		if (angle[i] < 0)
+			speed = -speed;
 
-	switch (dev->map_key[keyset][code].type) {
-		case FUNC_BTN:
-			btn = dev->map_key[keyset][code].u.btn;
-			xf86PostButtonEvent(dev->info->dev, absolute, btn,
-								state, 0, 0);
-			break;
-		case FUNC_KEY:
-			key = dev->map_key[keyset][code].u.key + MIN_KEYCODE;
-			xf86PostKeyboardEvent(dev->info->dev, key, state);
-			break;
-		case FUNC_IGNORE:
-			/* fallthrough */
-		default:
-			break;
+		dev->accel_joy_rem[i] += xwiimote_precision_smooth(dev, i,
+								   speed * dt);
+		out[i] = dev->accel_joy_rem[i];
+		dev->accel_joy_rem[i] -= out[i];
 	}
+	XWIIMOTE_PROBE(accel_joystick, out[0], out[1]);
+
+	if (out[0] || out[1])
+		xwiimote_post_motion(dev, &ev->time, FALSE, out[0], out[1]);
 }
 
 static void xwiimote_accel(struct xwiimote_dev *dev, struct xwii_event *ev)
 {
+	struct motion_sample *h;
 	int32_t x, y, r;
 	int absolute, i;
 
 	if (dev->motion_source != SOURCE_ACCEL)
 		return;
 
+	if (dev->accel_mode == ACCEL_TILT) {
+		xwiimote_accel_tilt(dev, ev);
+		return;
+	} else if (dev->accel_mode == ACCEL_JOYSTICK) {
+		xwiimote_accel_joystick(dev, ev);
+		return;
+	}
+
 	++dev->accel_history_cur;
 	dev->accel_history_cur %= XWIIMOTE_ACCEL_HISTORY_NUM;
-	dev->accel_history_ev[dev->accel_history_cur] = ev->v.abs[0];
-
-	/* choose the smallest one */
-	x = dev->accel_history_ev[0].x;
-	y = dev->accel_history_ev[0].y;
-	for (i = 1; i < XWIIMOTE_ACCEL_HISTORY_NUM; i++) {
-		if (dev->accel_history_ev[i].x < x)
-			x = dev->accel_history_ev[i].x;
-		if (dev->accel_history_ev[i].y < y)
-			y = dev->accel_history_ev[i].y;
+	h = &dev->accel_history_ev[dev->accel_history_cur];
+	h->time = ev->time;
+	h->x = ev->v.abs[0].x;
+	h->y = ev->v.abs[0].y;
+
+	/* choose the smallest one of all reports inside the history window */
+	x = h->x;
+	y = h->y;
+	for (i = 0; i < XWIIMOTE_ACCEL_HISTORY_NUM; i++) {
+		h = &dev->accel_history_ev[i];
+		if (timeval_diff_us(&ev->time, &h->time) >=
+		    dev->accel_history_ms * 1000)
+			continue;
+		if (h->x < x)
+			x = h->x;
+		if (h->y < y)
+			y = h->y;
 	}
 
+	XWIIMOTE_PROBE(accel_history, x, y);
+
 	/* limit values to make it more stable */
 	r = x % XWIIMOTE_ACCEL_HISTORY_MOD;
 	x -= r;
 	r = y % XWIIMOTE_ACCEL_HISTORY_MOD;
 	y -= r;
 
+	x = lround(xwiimote_precision_smooth(dev, 0, x));
+	y = lround(xwiimote_precision_smooth(dev, 1, y));
+
 	absolute = dev->motion == MOTION_ABS;
-	xf86PostMotionEvent(dev->info->dev, absolute, 0, 2, x, y);
+	xwiimote_post_motion(dev, &ev->time, absolute, x, y);
+}
+
+static void xwiimote_gesture_emit(struct xwiimote_dev *dev,
+				  const struct timeval *time, unsigned int g)
+{
+	struct timeval *t = &dev->gesture_cooldown_until;
+
+	xwiimote_func(dev, time, &dev->map_gesture[g], 1);
+	xwiimote_func(dev, time, &dev->map_gesture[g], 0);
+
+	*t = *time;
+	t->tv_usec += dev->gesture_cooldown_ms * 1000;
+	t->tv_sec += t->tv_usec / 1000000;
+	t->tv_usec %= 1000000;
+}
+
+/*
+ * Streaming gesture detection with constant cost per report. Gravity is
+ * tracked with a slow low-pass filter and subtracted. A peak of the remaining
+ * acceleration starts a gesture, which ends once the acceleration stayed low
+ * for the settle time: with enough direction changes it was a shake,
+ * otherwise a swing in the direction of the first peak. Twists are detected
+ * as fast changes of the roll angle against a slowly following reference.
+ */
+static void xwiimote_gesture(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	const struct xwii_event_abs *a = &ev->v.abs[0];
+	double raw[3], lin[3], dt, k, roll, d;
+	int i, axis, sign;
+
+	raw[0] = a->x;
+	raw[1] = a->y;
+	raw[2] = a->z;
+	dt = rate_update(&dev->gesture_rate, &ev->time) / 1000.0;
+	roll = atan2(raw[0], raw[2]) * 180.0 / M_PI;
+
+	if (!dev->gesture_grav_valid) {
+		for (i = 0; i < 3; ++i)
+			dev->gesture_grav[i] = raw[i];
+		dev->gesture_twist_ref = roll;
+		dev->gesture_grav_valid = true;
+		return;
+	}
+
+	axis = 0;
+	for (i = 0; i < 3; ++i) {
+		lin[i] = raw[i] - dev->gesture_grav[i];
+		if (fabs(lin[i]) > fabs(lin[axis]))
+			axis = i;
+	}
+
+	if (!dev->gesture_active) {
+		k = dt / (XWIIMOTE_GESTURE_GRAVITY_MS + dt);
+		for (i = 0; i < 3; ++i)
+			dev->gesture_grav[i] += (raw[i] - dev->gesture_grav[i]) * k;
+	}
+
+	if (timeval_diff_us(&ev->time, &dev->gesture_cooldown_until) < 0) {
+		dev->gesture_active = false;
+		dev->gesture_twist_ref = roll;
+		return;
+	}
+
+	/* swings and shakes */
+	if (fabs(lin[axis]) >= dev->gesture_threshold) {
+		sign = lin[axis] > 0 ? 1 : 0;
+		if (!dev->gesture_active) {
+			dev->gesture_active = true;
+			dev->gesture_axis = axis;
+			dev->gesture_sign = sign;
+			dev->gesture_last_sign = sign;
+			dev->gesture_reversals = 0;
+		} else if (axis == dev->gesture_axis &&
+			   sign != dev->gesture_last_sign) {
+			dev->gesture_last_sign = sign;
+			++dev->gesture_reversals;
+		}
+		dev->gesture_strong_time = ev->time;
+	} else if (dev->gesture_active &&
+		   timeval_diff_us(&ev->time, &dev->gesture_strong_time) >=
+		   XWIIMOTE_GESTURE_SETTLE_MS * 1000) {
+		dev->gesture_active = false;
+		if (dev->gesture_reversals >= XWIIMOTE_GESTURE_SHAKE_REVERSALS)
+			xwiimote_gesture_emit(dev, &ev->time, GESTURE_SHAKE);
+		else
+			xwiimote_gesture_emit(dev, &ev->time,
+					      GESTURE_SWING_LEFT +
+					      dev->gesture_axis * 2 +
+					      dev->gesture_sign);
+		dev->gesture_twist_ref = roll;
+		return;
+	}
+
+	if (dev->gesture_active)
+		return;
+
+	/* twists around the long axis */
+	d = roll - dev->gesture_twist_ref;
+	if (d > 180.0)
+		d -= 360.0;
+	else if (d < -180.0)
+		d += 360.0;
+
+	if (fabs(d) >= dev->gesture_twist_angle) {
+		xwiimote_gesture_emit(dev, &ev->time, d > 0 ?
+				      GESTURE_TWIST_RIGHT : GESTURE_TWIST_LEFT);
+		dev->gesture_twist_ref = roll;
+	} else {
+		dev->gesture_twist_ref += d * dt / (XWIIMOTE_TWIST_MS + dt);
+	}
 }
 
 static void xwiimote_ir(struct xwiimote_dev *dev, struct xwii_event *ev)
 {
 	struct xwii_event_abs *a, *b, *c, d;
-	int absolute, i, dists[6];
+	int absolute, i, dists[6], dt, max, weight;
+	int64_t t;
 
 	absolute = dev->motion == MOTION_ABS;
 
-	if (dev->motion_source != SOURCE_IR)
+	/* IR may only be open to select the IR key layer */
+	if (dev->motion_source != SOURCE_IR) {
+		for (i = 0; i < 4; ++i) {
+			if (xwii_event_ir_is_valid(&ev->v.abs[i])) {
+				dev->ir_last_valid_event = ev->time;
+				break;
+			}
+		}
 		return;
+	}
 
 	/* Grab first two valid points */
 	a = b = NULL;
@@ -521,27 +3325,38 @@ static void xwiimote_ir(struct xwiimote_dev *dev, struct xwii_event *ev)
 		dev->ir_ref_y = a->y;
 	}
 
+	XWIIMOTE_PROBE(ir_pair, a->x, a->y, b->x, b->y);
+
 	/* Final point is the average of both points */
 	a->x = (a->x + b->x) / 2;
 	a->y = (a->y + b->y) / 2;
 
-	/* Start averaging if the location is consistant */
-	dev->ir_avg_x = (dev->ir_avg_x * dev->ir_avg_count + a->x) / (dev->ir_avg_count+1);
-	dev->ir_avg_y = (dev->ir_avg_y * dev->ir_avg_count + a->y) / (dev->ir_avg_count+1);
-	if (++dev->ir_avg_count > dev->ir_avg_max_samples)
-		dev->ir_avg_count = dev->ir_avg_max_samples;
+	/* Start averaging if the location is consistant. Each report is
+	 * weighted by the measured report interval so the averaging window
+	 * covers the same time span regardless of the report rate. */
+	dt = rate_update(&dev->ir_rate, &ev->time);
+	t = dev->ir_avg_time;
+	dev->ir_avg_x = (dev->ir_avg_x * t + (int64_t)a->x * dt) / (t + dt);
+	dev->ir_avg_y = (dev->ir_avg_y * t + (int64_t)a->y * dt) / (t + dt);
+	max = dev->ir_avg_max_ms * 1000;
+	dev->ir_avg_time += dt;
+	if (dev->ir_avg_time > max)
+		dev->ir_avg_time = max;
 	if (XWIIMOTE_DISTSQ(a->x, a->y, dev->ir_avg_x, dev->ir_avg_y)
 			< dev->ir_avg_radius * dev->ir_avg_radius) {
-		if (dev->ir_avg_count >= dev->ir_avg_min_samples) {
-			a->x = (a->x + dev->ir_avg_x * dev->ir_avg_weight) / (dev->ir_avg_weight+1);
-			a->y = (a->y + dev->ir_avg_y * dev->ir_avg_weight) / (dev->ir_avg_weight+1);
+		if (dev->ir_avg_time >= dev->ir_avg_min_ms * 1000) {
+			weight = dev->ir_avg_weight;
+			if (dev->precision_held)
+				weight = (weight + 1) * dev->precision_smoothing - 1;
+			a->x = (a->x + dev->ir_avg_x * weight) / (weight+1);
+			a->y = (a->y + dev->ir_avg_y * weight) / (weight+1);
 		}
 	} else {
-		dev->ir_avg_count = 0;
+		dev->ir_avg_time = 0;
 	}
 
-	xf86PostMotionEvent(dev->info->dev, absolute, 0, 2,
-				1023 - a->x, a->y);
+	XWIIMOTE_PROBE(ir_average, a->x, a->y, dev->ir_avg_time);
+	xwiimote_post_motion(dev, &ev->time, absolute, 1023 - a->x, a->y);
 
 	dev->ir_last_valid_event = ev->time;
 }
@@ -576,6 +3391,70 @@ static int32_t get_mp_axis(struct xwiimote_dev *dev,
 	}
 }
 
+/*
+ * Pitch and roll follow from the direction of gravity, yaw is integrated
+ * from the normalized MotionPlus yaw rate. The pointer options MPXAxis and
+ * MPXScale do not apply, the orientation is absolute.
+ */
+static void xwiimote_orient_accel(struct xwiimote_dev *dev,
+				  struct xwii_event *ev)
+{
+	double x = ev->v.abs[0].x, y = ev->v.abs[0].y, z = ev->v.abs[0].z;
+
+	xwiimote_raw_set(dev, RAW_ORIENT, accel_angle(y, x, z) * 100);
+	xwiimote_raw_set(dev, RAW_ORIENT + 1, atan2(x, z) * 18000.0 / M_PI);
+}
+
+static void xwiimote_orient_mp(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	double dt;
+
+	dt = rate_update(&dev->orient_rate, &ev->time) / 1000000.0;
+	dev->orient_yaw += ev->v.abs[0].x * dt / dev->mp_units_per_deg;
+	if (dev->orient_yaw > 180.0)
+		dev->orient_yaw -= 360.0;
+	else if (dev->orient_yaw < -180.0)
+		dev->orient_yaw += 360.0;
+
+	xwiimote_raw_set(dev, RAW_ORIENT + 2, dev->orient_yaw * 100);
+}
+
+static void xwiimote_raw(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	unsigned int i;
+	bool valid;
+
+	switch (ev->type) {
+	case XWII_EVENT_ACCEL:
+		xwiimote_raw_set(dev, RAW_ACCEL, ev->v.abs[0].x);
+		xwiimote_raw_set(dev, RAW_ACCEL + 1, ev->v.abs[0].y);
+		xwiimote_raw_set(dev, RAW_ACCEL + 2, ev->v.abs[0].z);
+		if (dev->orientation)
+			xwiimote_orient_accel(dev, ev);
+		break;
+	case XWII_EVENT_MOTION_PLUS:
+		xwiimote_raw_set(dev, RAW_MOTIONPLUS, ev->v.abs[0].x);
+		xwiimote_raw_set(dev, RAW_MOTIONPLUS + 1, ev->v.abs[0].y);
+		xwiimote_raw_set(dev, RAW_MOTIONPLUS + 2, ev->v.abs[0].z);
+		if (dev->orientation)
+			xwiimote_orient_mp(dev, ev);
+		break;
+	case XWII_EVENT_IR:
+		/* invalid dots keep their last position */
+		for (i = 0; i < 4; ++i) {
+			valid = xwii_event_ir_is_valid(&ev->v.abs[i]);
+			if (valid) {
+				xwiimote_raw_set(dev, RAW_IR + i * 3,
+						 ev->v.abs[i].x);
+				xwiimote_raw_set(dev, RAW_IR + i * 3 + 1,
+						 ev->v.abs[i].y);
+			}
+			xwiimote_raw_set(dev, RAW_IR + i * 3 + 2, valid);
+		}
+		break;
+	}
+}
+
 static void xwiimote_motionplus(struct xwiimote_dev *dev, struct xwii_event *ev)
 {
 	int32_t x, z;
@@ -586,60 +3465,546 @@ static void xwiimote_motionplus(struct xwiimote_dev *dev, struct xwii_event *ev)
 	if (dev->motion_source == SOURCE_MOTIONPLUS) {
 		x = get_mp_axis(dev, ev, 0) / 100;
 		z = get_mp_axis(dev, ev, 2) / 100;
-		xf86PostMotionEvent(dev->info->dev, absolute, 0, 2, x, z);
+		x = lround(xwiimote_precision_smooth(dev, 0, x));
+		z = lround(xwiimote_precision_smooth(dev, 1, z));
+		XWIIMOTE_PROBE(motionplus, x, z);
+		xwiimote_post_motion(dev, &ev->time, absolute, x, z);
+	}
+}
+
+static void xwiimote_publish_idle(struct xwiimote_dev *dev)
+{
+	uint8_t val;
+
+	if (!dev->idle_prop || dev->idle_published == dev->idle)
+		return;
+
+	dev->idle_published = dev->idle;
+	val = dev->idle;
+	XIChangeDeviceProperty(dev->info->dev, dev->idle_prop, XA_INTEGER, 8,
+			       PropModeReplace, 1, &val, TRUE);
+}
+
+/*
+ * Runs in the main thread: enters idle mode once the timeout passed without
+ * activity and publishes the idle state. Activity only records its time, so
+ * the timer is simply re-armed for the remaining time.
+ */
+static CARD32 xwiimote_idle_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	struct xwiimote_dev *dev = arg;
+	struct timeval tv;
+	int64_t left;
+	int sigstate;
+	CARD32 next = 0;
+
+	sigstate = xwiimote_input_lock();
+
+	if (!dev->idle) {
+		gettimeofday(&tv, NULL);
+		left = dev->idle_timeout_secs * 1000000LL -
+		       timeval_diff_us(&tv, &dev->idle_last);
+		if (left > 0) {
+			next = left / 1000 + 1;
+		} else {
+			dev->idle = true;
+			xwiimote_sync_ifs(dev);
+		}
+	}
+
+	xwiimote_input_unlock(sigstate);
+
+	xwiimote_publish_idle(dev);
+	return next;
+}
+
+static void xwiimote_activity(struct xwiimote_dev *dev,
+			      const struct timeval *time)
+{
+	dev->idle_last = *time;
+	if (!dev->idle)
+		return;
+
+	dev->idle = false;
+	xwiimote_sync_ifs(dev);
+
+	/* property changes must not happen in the input path */
+	dev->idle_timer = TimerSet(dev->idle_timer, 0, 1,
+				   xwiimote_idle_timer, dev);
+}
+
+/* Movement is detected as variance of the accelerometer readings */
+static void xwiimote_idle_accel(struct xwiimote_dev *dev,
+				struct xwii_event *ev)
+{
+	const struct xwii_event_abs *a = &ev->v.abs[0];
+	double d[3], var;
+	int i;
+
+	d[0] = a->x - dev->idle_accel_mean[0];
+	d[1] = a->y - dev->idle_accel_mean[1];
+	d[2] = a->z - dev->idle_accel_mean[2];
+
+	var = 0;
+	for (i = 0; i < 3; ++i) {
+		dev->idle_accel_mean[i] += d[i] / 8;
+		var += d[i] * d[i];
+	}
+	dev->idle_accel_var += (var - dev->idle_accel_var) / 8;
+
+	if (dev->idle_accel_var >
+	    dev->idle_motion_threshold * dev->idle_motion_threshold)
+		xwiimote_activity(dev, &ev->time);
+}
+
+static void xwiimote_idle_ir(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		if (xwii_event_ir_is_valid(&ev->v.abs[i])) {
+			xwiimote_activity(dev, &ev->time);
+			return;
+		}
+	}
+}
+
+static double stick_speed(struct xwiimote_dev *dev, struct stick *st, int v)
+{
+	int idx = abs(v) * XWIIMOTE_STICK_RES / st->range;
+
+	if (idx > XWIIMOTE_STICK_RES)
+		idx = XWIIMOTE_STICK_RES;
+
+	return v < 0 ? -dev->stick_lut[idx] : dev->stick_lut[idx];
+}
+
+static void stick_reset(struct stick *st)
+{
+	st->x = 0;
+	st->y = 0;
+}
+
+static bool stick_deflected(struct xwiimote_dev *dev, struct stick *st)
+{
+	return st->range && (stick_speed(dev, st, st->x) ||
+			     stick_speed(dev, st, st->y));
+}
+
+/*
+ * Sticks only report changes, so held sticks are turned into motion or
+ * scrolling from a timer until all of them return into the deadzone.
+ */
+static CARD32 xwiimote_stick_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	struct xwiimote_dev *dev = arg;
+	struct stick *st;
+	struct timeval tv;
+	double dt, motion[2] = { 0, 0 }, scroll[2] = { 0, 0 }, *out;
+	bool active = false;
+	int sigstate, i, move[2];
+	CARD32 next = XWIIMOTE_SCROLL_FRAME_MS;
+
+	sigstate = xwiimote_input_lock();
+
+	dt = (CARD32)(now - dev->stick_last) / 1000.0;
+	dev->stick_last = now;
+
+	for (i = 0; i < STICK_NUM; ++i) {
+		st = &dev->sticks[i];
+		if (st->mode == STICK_OFF || !stick_deflected(dev, st))
+			continue;
+
+		active = true;
+		out = st->mode == STICK_SCROLL ? scroll : motion;
+		/* stick up is positive, screen coordinates grow downwards */
+		out[0] += stick_speed(dev, st, st->x) * dt;
+		out[1] -= stick_speed(dev, st, st->y) * dt;
+	}
+
+	if (!active) {
+		dev->stick_timer_armed = false;
+		next = 0;
+		goto out_unlock;
+	}
+
+	if (scroll[0] || scroll[1])
+		xwiimote_post_scroll(dev, scroll[0], scroll[1]);
+
+	for (i = 0; i < 2; ++i) {
+		dev->stick_rem[i] += xwiimote_precision_smooth(dev, 2 + i,
+							       motion[i]);
+		move[i] = dev->stick_rem[i];
+		dev->stick_rem[i] -= move[i];
+	}
+
+	if (move[0] || move[1]) {
+		gettimeofday(&tv, NULL);
+		xwiimote_post_motion(dev, &tv, FALSE, move[0], move[1]);
+	}
+
+out_unlock:
+	xwiimote_input_unlock(sigstate);
+	return next;
+}
+
+static void xwiimote_stick(struct xwiimote_dev *dev, const struct timeval *time,
+			   enum stick_id id, const struct xwii_event_abs *pos,
+			   int range)
+{
+	struct stick *st = &dev->sticks[id];
+
+	if (st->mode == STICK_OFF)
+		return;
+
+	st->x = pos->x;
+	st->y = pos->y;
+	if (st->range < range)
+		st->range = range;
+	if (st->range < abs(st->x))
+		st->range = abs(st->x);
+	if (st->range < abs(st->y))
+		st->range = abs(st->y);
+
+	if (!stick_deflected(dev, st))
+		return;
+
+	if (dev->idle_timeout_secs)
+		xwiimote_activity(dev, time);
+
+	if (!dev->stick_timer_armed) {
+		dev->stick_timer_armed = true;
+		dev->stick_last = GetTimeInMillis();
+		dev->stick_rem[0] = 0;
+		dev->stick_rem[1] = 0;
+		dev->stick_timer = TimerSet(dev->stick_timer, 0,
+					    XWIIMOTE_SCROLL_FRAME_MS,
+					    xwiimote_stick_timer, dev);
+	}
+}
+
+/*
+ * The four load cells are reported as top-right, bottom-right, top-left and
+ * bottom-left. The offsets of an empty board are averaged over the first
+ * reports after connecting. Afterwards the center of pressure is computed in
+ * integer math and fed into the stick code.
+ */
+static void xwiimote_board(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	struct xwii_event_abs pos = { 0, 0, 0 };
+	int32_t w[4], total = 0;
+	unsigned int i;
+
+	for (i = 0; i < 4; ++i) {
+		w[i] = ev->v.abs[i].x;
+		total += w[i];
+	}
+
+	if (dev->board_tare_num < XWIIMOTE_BOARD_TARE_NUM) {
+		/* somebody already stands on the board, skip taring */
+		if (total >= XWIIMOTE_BOARD_MIN_LOAD) {
+			dev->board_tare_num = XWIIMOTE_BOARD_TARE_NUM;
+			return;
+		}
+
+		for (i = 0; i < 4; ++i)
+			dev->board_tare_sum[i] += w[i];
+		if (++dev->board_tare_num == XWIIMOTE_BOARD_TARE_NUM) {
+			for (i = 0; i < 4; ++i)
+				dev->board_tare[i] = dev->board_tare_sum[i] /
+						     XWIIMOTE_BOARD_TARE_NUM;
+		}
+		return;
+	}
+
+	total = 0;
+	for (i = 0; i < 4; ++i) {
+		w[i] -= dev->board_tare[i];
+		total += w[i];
 	}
+
+	if (total >= XWIIMOTE_BOARD_MIN_LOAD) {
+		pos.x = (w[0] + w[1] - w[2] - w[3]) * XWIIMOTE_BOARD_RES / total;
+		pos.y = (w[0] + w[2] - w[1] - w[3]) * XWIIMOTE_BOARD_RES / total;
+	}
+
+	xwiimote_stick(dev, &ev->time, STICK_BOARD, &pos, XWIIMOTE_BOARD_RANGE);
+}
+
+static void xwiimote_board_reset(struct xwiimote_dev *dev)
+{
+	memset(dev->board_tare, 0, sizeof(dev->board_tare));
+	memset(dev->board_tare_sum, 0, sizeof(dev->board_tare_sum));
+	dev->board_tare_num = 0;
+	stick_reset(&dev->sticks[STICK_BOARD]);
+}
+
+static void xwiimote_sticks(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	switch (ev->type) {
+	case XWII_EVENT_NUNCHUK_MOVE:
+		xwiimote_stick(dev, &ev->time, STICK_NUNCHUK, &ev->v.abs[0],
+			       XWIIMOTE_NUNCHUK_RANGE);
+		break;
+	case XWII_EVENT_CLASSIC_CONTROLLER_MOVE:
+		xwiimote_stick(dev, &ev->time, STICK_LEFT, &ev->v.abs[0],
+			       XWIIMOTE_CLASSIC_LEFT_RANGE);
+		xwiimote_stick(dev, &ev->time, STICK_RIGHT, &ev->v.abs[1],
+			       XWIIMOTE_CLASSIC_RIGHT_RANGE);
+		break;
+	case XWII_EVENT_PRO_CONTROLLER_MOVE:
+		xwiimote_stick(dev, &ev->time, STICK_LEFT, &ev->v.abs[0],
+			       XWIIMOTE_PRO_RANGE);
+		xwiimote_stick(dev, &ev->time, STICK_RIGHT, &ev->v.abs[1],
+			       XWIIMOTE_PRO_RANGE);
+		break;
+	}
+}
+/* Select all layers that are bound to the currently plugged extension */
+static void xwiimote_update_extension(struct xwiimote_dev *dev)
+{
+	char *ext = NULL;
+	unsigned int i, mask = 0;
+
+	if (!dev->layer_ext_mask)
+		return;
+
+	if (!xwii_iface_get_extension(dev->iface, &ext) && ext) {
+		for (i = 1; i < XWIIMOTE_LAYER_NUM; ++i) {
+			if (dev->layers[i].select == LAYER_SELECT_EXTENSION &&
+			    !strcasecmp(ext, dev->layers[i].extension))
+				mask |= 1U << i;
+		}
+	}
+	free(ext);
+
+	dev->layer_state &= ~dev->layer_ext_mask;
+	dev->layer_state |= mask;
 }
 
 static void xwiimote_refresh(struct xwiimote_dev *dev)
 {
+	unsigned int opened;
+
+	xwiimote_sync_ifs(dev);
+	xwiimote_update_extension(dev);
+
+	/* an unplugged extension leaves its last stick positions behind */
+	opened = xwii_iface_opened(dev->iface);
+	if (!(opened & XWII_IFACE_NUNCHUK))
+		stick_reset(&dev->sticks[STICK_NUNCHUK]);
+	if (!(opened & (XWII_IFACE_CLASSIC_CONTROLLER |
+			XWII_IFACE_PRO_CONTROLLER))) {
+		stick_reset(&dev->sticks[STICK_LEFT]);
+		stick_reset(&dev->sticks[STICK_RIGHT]);
+	}
+	if (!(opened & XWII_IFACE_BALANCE_BOARD))
+		xwiimote_board_reset(dev);
+}
+
+static void xwiimote_handle(struct xwiimote_dev *dev, struct xwii_event *ev)
+{
+	if (dev->rec_on)
+		xwiimote_rec_input(dev, ev);
+
+	if (dev->raw_used)
+		xwiimote_raw(dev, ev);
+
+	switch (ev->type) {
+		case XWII_EVENT_WATCH:
+			xwiimote_refresh(dev);
+			break;
+		case XWII_EVENT_KEY:
+			if (dev->idle_timeout_secs)
+				xwiimote_activity(dev, &ev->time);
+			xwiimote_key(dev, ev);
+			break;
+		case XWII_EVENT_ACCEL:
+			if (dev->idle_timeout_secs)
+				xwiimote_idle_accel(dev, ev);
+			if (dev->gestures)
+				xwiimote_gesture(dev, ev);
+			xwiimote_accel(dev, ev);
+			break;
+		case XWII_EVENT_IR:
+			if (dev->idle_timeout_secs)
+				xwiimote_idle_ir(dev, ev);
+			xwiimote_ir(dev, ev);
+			break;
+		case XWII_EVENT_MOTION_PLUS:
+			xwiimote_motionplus(dev, ev);
+			break;
+		case XWII_EVENT_NUNCHUK_KEY:
+		case XWII_EVENT_CLASSIC_CONTROLLER_KEY:
+		case XWII_EVENT_PRO_CONTROLLER_KEY:
+			if (dev->idle_timeout_secs)
+				xwiimote_activity(dev, &ev->time);
+			xwiimote_key(dev, ev);
+			break;
+		case XWII_EVENT_NUNCHUK_MOVE:
+		case XWII_EVENT_CLASSIC_CONTROLLER_MOVE:
+		case XWII_EVENT_PRO_CONTROLLER_MOVE:
+			xwiimote_sticks(dev, ev);
+			break;
+		case XWII_EVENT_BALANCE_BOARD:
+			xwiimote_board(dev, ev);
+			break;
+	}
+
+	if (dev->raw_changed)
+		xwiimote_post_raw(dev);
+}
+
+static void xwiimote_input(int fd, pointer data)
+{
+	struct xwiimote_dev *dev = data;
+	InputInfoPtr info = dev->info;
+	struct xwii_event ev;
 	int ret;
 
-	ret = xwii_iface_open(dev->iface, dev->ifs);
-	if (ret)
-		xf86IDrvMsg(dev->info, X_INFO, "Cannot open all requested interfaces\n");
+	dev = info->private;
+	if (dev->dup)
+		return;
+
+	XWIIMOTE_PROBE(input_entry, fd);
+
+	do {
+		memset(&ev, 0, sizeof(ev));
+		ret = xwii_iface_dispatch(dev->iface, &ev, sizeof(ev));
+		XWIIMOTE_PROBE(dispatch, ret, ev.type);
+		if (!ret)
+			xwiimote_handle(dev, &ev);
+	} while (!ret);
+
+	if (ret != -EAGAIN) {
+		xf86IDrvMsg(info, X_INFO, "Device disconnected\n");
+		xf86RemoveInputHandler(dev->handler);
+		TimerCancel(dev->open_timer);
+		xwiimote_open_cancel(dev);
+		xwii_iface_close(dev->iface, XWII_IFACE_ALL);
+		xwiimote_direct_trim(dev, 0);
+		info->fd = -1;
+	}
+}
+
+/*
+ * Learned calibration is kept per remote in a small text file with one line
+ * per Bluetooth address: the MotionPlus bias followed by the IR dot distance
+ * vector. The file is rewritten at most once per XWIIMOTE_CALIB_SAVE_SECS
+ * and when the device is disabled, and only if the values changed.
+ */
+static void xwiimote_calib_get(struct xwiimote_dev *dev, int32_t *c)
+{
+	int32_t factor;
+
+	memset(c, 0, sizeof(*c) * XWIIMOTE_CALIB_NUM);
+	if (dev->mp_learn)
+		xwii_iface_get_mp_normalization(dev->iface, &c[0], &c[1], &c[2],
+						&factor);
+	c[3] = dev->ir_vec_x;
+	c[4] = dev->ir_vec_y;
+}
+
+static void xwiimote_calib_load(struct xwiimote_dev *dev)
+{
+	FILE *f;
+	char line[XWIIMOTE_CALIB_LINE], uniq[64];
+	int32_t c[XWIIMOTE_CALIB_NUM], x, y, z, factor;
+
+	if (!dev->calib_file || !dev->uniq)
+		return;
+
+	f = fopen(dev->calib_file, "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %" SCNd32 " %" SCNd32 " %" SCNd32
+				 " %" SCNd32 " %" SCNd32, uniq, &c[0], &c[1],
+			   &c[2], &c[3], &c[4]) != 6 ||
+		    strcmp(uniq, dev->uniq))
+			continue;
+
+		if (dev->mp_learn) {
+			xwii_iface_get_mp_normalization(dev->iface, &x, &y, &z,
+							&factor);
+			xwii_iface_set_mp_normalization(dev->iface, c[0], c[1],
+							c[2], factor);
+		}
+		dev->ir_vec_x = c[3];
+		dev->ir_vec_y = c[4];
+
+		xwiimote_calib_get(dev, dev->calib_saved);
+		xf86IDrvMsg(dev->info, X_INFO, "Loaded calibration for %s\n",
+			    dev->uniq);
+		break;
+	}
+
+	fclose(f);
+}
+
+static void xwiimote_calib_save(struct xwiimote_dev *dev, const int32_t *c)
+{
+	char tmp[PATH_MAX], line[XWIIMOTE_CALIB_LINE], uniq[64];
+	FILE *in, *out;
+	int ret;
+
+	ret = snprintf(tmp, sizeof(tmp), "%s.tmp", dev->calib_file);
+	if (ret < 0 || ret >= (int)sizeof(tmp))
+		return;
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		if (!dev->calib_warned)
+			xf86IDrvMsg(dev->info, X_WARNING,
+				    "Cannot write calibration to %s: %s\n",
+				    dev->calib_file, strerror(errno));
+		dev->calib_warned = true;
+		return;
+	}
+
+	in = fopen(dev->calib_file, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			if (sscanf(line, "%63s", uniq) == 1 &&
+			    strcmp(uniq, dev->uniq))
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s %" PRId32 " %" PRId32 " %" PRId32 " %" PRId32
+		     " %" PRId32 "\n", dev->uniq, c[0], c[1], c[2], c[3], c[4]);
+
+	if (fclose(out) || rename(tmp, dev->calib_file)) {
+		xf86IDrvMsg(dev->info, X_WARNING, "Cannot save calibration\n");
+		unlink(tmp);
+		return;
+	}
+
+	memcpy(dev->calib_saved, c, sizeof(dev->calib_saved));
 }
 
-static void xwiimote_input(int fd, pointer data)
+static void xwiimote_calib_flush(struct xwiimote_dev *dev)
 {
-	struct xwiimote_dev *dev = data;
-	InputInfoPtr info = dev->info;
-	struct xwii_event ev;
-	int ret;
+	int32_t c[XWIIMOTE_CALIB_NUM];
+	int sigstate;
 
-	dev = info->private;
-	if (dev->dup)
+	if (!dev->calib_file || !dev->uniq)
 		return;
 
-	do {
-		memset(&ev, 0, sizeof(ev));
-		ret = xwii_iface_dispatch(dev->iface, &ev, sizeof(ev));
-		if (ret)
-			break;
+	sigstate = xwiimote_input_lock();
+	xwiimote_calib_get(dev, c);
+	xwiimote_input_unlock(sigstate);
 
-		switch (ev.type) {
-			case XWII_EVENT_WATCH:
-				xwiimote_refresh(dev);
-				break;
-			case XWII_EVENT_KEY:
-				xwiimote_key(dev, &ev);
-				break;
-			case XWII_EVENT_ACCEL:
-				xwiimote_accel(dev, &ev);
-				break;
-			case XWII_EVENT_IR:
-				xwiimote_ir(dev, &ev);
-			case XWII_EVENT_MOTION_PLUS:
-				xwiimote_motionplus(dev, &ev);
-				break;
-		}
-	} while (!ret);
+	if (memcmp(c, dev->calib_saved, sizeof(c)))
+		xwiimote_calib_save(dev, c);
+}
 
-	if (ret != -EAGAIN) {
-		xf86IDrvMsg(info, X_INFO, "Device disconnected\n");
-		xf86RemoveInputHandler(dev->handler);
-		xwii_iface_close(dev->iface, XWII_IFACE_ALL);
-		info->fd = -1;
-	}
+static CARD32 xwiimote_calib_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	xwiimote_calib_flush(arg);
+	return XWIIMOTE_CALIB_SAVE_SECS * 1000;
 }
 
 static int xwiimote_on(struct xwiimote_dev *dev, DeviceIntPtr device)
@@ -647,14 +4012,22 @@ static int xwiimote_on(struct xwiimote_dev *dev, DeviceIntPtr device)
 	int ret;
 	InputInfoPtr info = device->public.devicePrivate;
 
-	ret = xwii_iface_open(dev->iface, dev->ifs);
-	if (ret)
-		xf86IDrvMsg(dev->info, X_INFO, "Cannot open all requested interfaces\n");
+	gettimeofday(&dev->bringup_start, NULL);
+	dev->bringup = true;
+	dev->open_failed = 0;
+	dev->open_retries = 0;
+	xwiimote_board_reset(dev);
+	xwiimote_sync_ifs(dev);
+	/* the timer also reports the bring-up time once all is open */
+	dev->open_timer = TimerSet(dev->open_timer, 0, 1, xwiimote_open_timer,
+				   dev);
 
 	ret = xwii_iface_watch(dev->iface, true);
 	if (ret)
 		xf86IDrvMsg(dev->info, X_ERROR, "Cannot watch device for hotplug events\n");
 
+	xwiimote_update_extension(dev);
+
 	info->fd = xwii_iface_get_fd(dev->iface);
 	if (info->fd >= 0) {
 		dev->handler = xf86AddInputHandler(info->fd, xwiimote_input, dev);
@@ -662,6 +4035,21 @@ static int xwiimote_on(struct xwiimote_dev *dev, DeviceIntPtr device)
 		xf86IDrvMsg(dev->info, X_ERROR, "Cannot get interface fd\n");
 	}
 
+	if (dev->idle_timeout_secs) {
+		gettimeofday(&dev->idle_last, NULL);
+		dev->idle_timer = TimerSet(dev->idle_timer, 0,
+					   dev->idle_timeout_secs * 1000,
+					   xwiimote_idle_timer, dev);
+	}
+
+	if (dev->mpx)
+		xwiimote_mpx_attach(dev);
+
+	if (dev->calib_file && dev->uniq)
+		dev->calib_timer = TimerSet(dev->calib_timer, 0,
+					    XWIIMOTE_CALIB_SAVE_SECS * 1000,
+					    xwiimote_calib_timer, dev);
+
 	device->public.on = TRUE;
 
 	return Success;
@@ -670,15 +4058,40 @@ static int xwiimote_on(struct xwiimote_dev *dev, DeviceIntPtr device)
 static int xwiimote_off(struct xwiimote_dev *dev, DeviceIntPtr device)
 {
 	InputInfoPtr info = device->public.devicePrivate;
+	unsigned int i;
 
 	device->public.on = FALSE;
 
+	TimerCancel(dev->key_timer);
+	dev->key_pending = -1;
+	memset(dev->key_state, 0, sizeof(dev->key_state));
+	TimerCancel(dev->scroll_timer);
+	dev->scroll_held = 0;
+	TimerCancel(dev->motion_timer);
+	dev->motion_timer_armed = false;
+	dev->motion_pending = false;
+	TimerCancel(dev->stick_timer);
+	dev->stick_timer_armed = false;
+	for (i = 0; i < STICK_NUM; ++i)
+		stick_reset(&dev->sticks[i]);
+	TimerCancel(dev->open_timer);
+	xwiimote_open_cancel(dev);
+	dev->bringup = false;
+	TimerCancel(dev->idle_timer);
+	dev->idle = false;
+	xwiimote_publish_idle(dev);
+	xwiimote_mpx_release(dev);
+
 	if (info->fd >= 0) {
 		xf86RemoveInputHandler(dev->handler);
 		xwii_iface_watch(dev->iface, false);
 		xwii_iface_close(dev->iface, XWII_IFACE_ALL);
 		info->fd = -1;
 	}
+	xwiimote_direct_trim(dev, 0);
+
+	TimerCancel(dev->calib_timer);
+	xwiimote_calib_flush(dev);
 
 	return Success;
 }
@@ -707,6 +4120,18 @@ static int xwiimote_control(DeviceIntPtr device, int what)
 	}
 }
 
+/*
+ * Extensions of a Wii Remote get input devices of their own, which are all
+ * handled by the driver instance of the remote. Pro Controllers and Balance
+ * Boards have no core device, their own device is used instead.
+ */
+static BOOL xwiimote_is_primary(const char *name)
+{
+	return !strcmp(name, XWII_NAME_CORE) ||
+	       !strcmp(name, XWII_NAME_PRO_CONTROLLER) ||
+	       !strcmp(name, XWII_NAME_BALANCE_BOARD);
+}
+
 /*
  * Check whether the device is actually a Wii Remote device and then retrieve
  * the sys-root of the HID device with the device-id.
@@ -718,7 +4143,7 @@ static BOOL xwiimote_validate(struct xwiimote_dev *dev)
 	struct udev_device *d, *p;
 	struct stat st;
 	BOOL ret = TRUE;
-	const char *root, *snum, *driver, *subs;
+	const char *root, *snum, *driver, *subs, *uniq;
 	int num;
 
 	udev = udev_new();
@@ -779,6 +4204,11 @@ static BOOL xwiimote_validate(struct xwiimote_dev *dev)
 		goto err_dev;
 	}
 
+	/* Bluetooth address, keys the calibration cache */
+	uniq = udev_device_get_property_value(p, "HID_UNIQ");
+	if (uniq && uniq[0] && !strchr(uniq, ' '))
+		dev->uniq = strdup(uniq);
+
 	dev->dev_id = num;
 
 err_dev:
@@ -1318,6 +4748,10 @@ static void parse_key(struct xwiimote_dev *dev, const char *key, struct func *ou
 	} else if (!strcasecmp(key, "middle-button")) {
 		out->type = FUNC_BTN;
 		out->u.btn = 2;
+	} else if (!strcasecmp(key, "precision")) {
+		out->type = FUNC_PRECISION;
+	} else if (!strcasecmp(key, "scroll")) {
+		out->type = FUNC_SCROLL;
 	} else {
 		for (i = 0; key2value[i].key; ++i) {
 			if (!strcasecmp(key2value[i].key, key))
@@ -1384,6 +4818,7 @@ static void xwiimote_configure_mp(struct xwiimote_dev *dev)
 	    !strcasecmp(normalize, "true") ||
 	    !strcasecmp(normalize, "yes")) {
 		xwii_iface_set_mp_normalization(dev->iface, 0, 0, 0, fac);
+		dev->mp_learn = fac > 0;
 		xf86IDrvMsg(dev->info, X_INFO,
 			    "MP-Normalizer started with (0:0:0) * %i\n", fac);
 	} else if (sscanf(normalize, "%i:%i:%i", &x, &y, &z) == 3) {
@@ -1407,6 +4842,109 @@ static void xwiimote_configure_mp(struct xwiimote_dev *dev)
 	parse_scale(dev, t, &dev->mp_z_scale);
 }
 
+/*
+ * Parse a filter length in milliseconds. For backwards compatibility, the
+ * length can also be given as number of reports via the legacy option, which
+ * is converted with the nominal report interval.
+ */
+static void parse_msecs(struct xwiimote_dev *dev, const char *ms_opt,
+			const char *samples_opt, int *out)
+{
+	const char *t;
+	int samples = 0;
+
+	t = xf86FindOptionValue(dev->info->options, ms_opt);
+	if (t) {
+		parse_scale(dev, t, out);
+	} else if (samples_opt) {
+		t = xf86FindOptionValue(dev->info->options, samples_opt);
+		parse_scale(dev, t, &samples);
+		if (samples)
+			*out = samples * (XWIIMOTE_RATE_DEFAULT_US / 1000);
+	}
+}
+
+/*
+ * Precompute the joystick speed curve: no motion inside the deadzone, then
+ * the speed rises along the configured power curve and reaches its maximum at
+ * AccelTiltRange degrees.
+ */
+static void accel_joy_compute_lut(struct xwiimote_dev *dev)
+{
+	double angle, v;
+	int i;
+
+	for (i = 0; i < XWIIMOTE_ACCEL_JOY_STEPS; ++i) {
+		angle = i * 90.0 / (XWIIMOTE_ACCEL_JOY_STEPS - 1);
+		if (angle <= dev->accel_joy_deadzone) {
+			v = 0;
+		} else {
+			v = (angle - dev->accel_joy_deadzone) /
+			    (dev->accel_tilt_range - dev->accel_joy_deadzone);
+			if (v > 1.0)
+				v = 1.0;
+			v = pow(v, dev->accel_joy_curve);
+		}
+
+		dev->accel_joy_lut[i] = v * dev->accel_joy_speed;
+	}
+}
+
+static void xwiimote_configure_accel(struct xwiimote_dev *dev)
+{
+	const char *t;
+
+	parse_msecs(dev, "AccelHistoryMs", NULL, &dev->accel_history_ms);
+	if (dev->accel_history_ms < 1) dev->accel_history_ms = 1;
+	else if (dev->accel_history_ms > XWIIMOTE_ACCEL_HISTORY_MAX_MS)
+		dev->accel_history_ms = XWIIMOTE_ACCEL_HISTORY_MAX_MS;
+
+	t = xf86FindOptionValue(dev->info->options, "AccelMode");
+	if (!t)
+		t = "";
+
+	if (!strcasecmp(t, "tilt"))
+		dev->accel_mode = ACCEL_TILT;
+	else if (!strcasecmp(t, "joystick"))
+		dev->accel_mode = ACCEL_JOYSTICK;
+	else if (t[0] && strcasecmp(t, "minimum"))
+		xf86IDrvMsg(dev->info, X_ERROR, "Invalid AccelMode %s\n", t);
+
+	t = xf86FindOptionValue(dev->info->options, "AccelTiltRange");
+	parse_scale(dev, t, &dev->accel_tilt_range);
+	if (dev->accel_tilt_range < 1) dev->accel_tilt_range = 1;
+	else if (dev->accel_tilt_range > 90) dev->accel_tilt_range = 90;
+
+	t = xf86FindOptionValue(dev->info->options, "AccelSmoothMs");
+	parse_scale(dev, t, &dev->accel_smooth_ms);
+	if (dev->accel_smooth_ms < 1) dev->accel_smooth_ms = 1;
+
+	t = xf86FindOptionValue(dev->info->options, "AccelDeadband");
+	parse_scale(dev, t, &dev->accel_deadband);
+	if (dev->accel_deadband < 0) dev->accel_deadband = 0;
+
+	t = xf86FindOptionValue(dev->info->options, "AccelJoystickDeadzone");
+	parse_scale(dev, t, &dev->accel_joy_deadzone);
+	if (dev->accel_joy_deadzone < 0) dev->accel_joy_deadzone = 0;
+	else if (dev->accel_joy_deadzone >= dev->accel_tilt_range)
+		dev->accel_joy_deadzone = dev->accel_tilt_range - 1;
+
+	t = xf86FindOptionValue(dev->info->options, "AccelJoystickSpeed");
+	parse_scale(dev, t, &dev->accel_joy_speed);
+	if (dev->accel_joy_speed < 0) dev->accel_joy_speed = 0;
+
+	dev->accel_joy_curve = xf86SetRealOption(dev->info->options,
+						 "AccelJoystickCurve",
+						 XWIIMOTE_ACCEL_JOY_CURVE);
+	if (dev->accel_joy_curve <= 0) dev->accel_joy_curve = 1.0;
+
+	if (dev->accel_mode == ACCEL_JOYSTICK) {
+		if (dev->motion_source == SOURCE_ACCEL)
+			dev->motion = MOTION_REL;
+		accel_joy_compute_lut(dev);
+	}
+}
+
 static void xwiimote_configure_ir(struct xwiimote_dev *dev)
 {
 	const char *t;
@@ -1414,16 +4952,14 @@ static void xwiimote_configure_ir(struct xwiimote_dev *dev)
 	t = xf86FindOptionValue(dev->info->options, "IRAvgRadius");
 	parse_scale(dev, t, &dev->ir_avg_radius);
 
-	t = xf86FindOptionValue(dev->info->options, "IRAvgMaxSamples");
-	parse_scale(dev, t, &dev->ir_avg_max_samples);
-	if (dev->ir_avg_max_samples < 1) dev->ir_avg_max_samples = 1;
+	parse_msecs(dev, "IRAvgMaxMs", "IRAvgMaxSamples", &dev->ir_avg_max_ms);
+	if (dev->ir_avg_max_ms < 1) dev->ir_avg_max_ms = 1;
 
-	t = xf86FindOptionValue(dev->info->options, "IRAvgMinSamples");
-	parse_scale(dev, t, &dev->ir_avg_min_samples);
-	if (dev->ir_avg_min_samples < 1) {
-		dev->ir_avg_min_samples = 1;
-	} else if (dev->ir_avg_min_samples > dev->ir_avg_max_samples) {
-		dev->ir_avg_min_samples = dev->ir_avg_max_samples;
+	parse_msecs(dev, "IRAvgMinMs", "IRAvgMinSamples", &dev->ir_avg_min_ms);
+	if (dev->ir_avg_min_ms < 1) {
+		dev->ir_avg_min_ms = 1;
+	} else if (dev->ir_avg_min_ms > dev->ir_avg_max_ms) {
+		dev->ir_avg_min_ms = dev->ir_avg_max_ms;
 	}
 
 	t = xf86FindOptionValue(dev->info->options, "IRAvgWeight");
@@ -1434,108 +4970,578 @@ static void xwiimote_configure_ir(struct xwiimote_dev *dev)
 	parse_scale(dev, t, &dev->ir_keymap_expiry_secs);
 }
 
-static void xwiimote_configure(struct xwiimote_dev *dev)
+static void xwiimote_configure_click_lock(struct xwiimote_dev *dev)
 {
-	const char *motion, *key;
+	const char *t;
 
-	memcpy(dev->map_key[KEYSET_NORMAL], map_key_default, sizeof(map_key_default));
-	memcpy(dev->map_key[KEYSET_IR], map_key_default, sizeof(map_key_default));
+	t = xf86FindOptionValue(dev->info->options, "ClickLockMs");
+	parse_scale(dev, t, &dev->click_lock_ms);
+	if (dev->click_lock_ms < 0) dev->click_lock_ms = 0;
 
-	motion = xf86FindOptionValue(dev->info->options, "MotionSource");
-	if (!motion)
-		motion = "";
+	t = xf86FindOptionValue(dev->info->options, "ClickLockLookbackMs");
+	parse_scale(dev, t, &dev->click_lock_lookback_ms);
+	if (dev->click_lock_lookback_ms < 0) dev->click_lock_lookback_ms = 0;
+}
 
-	if (!strcasecmp(motion, "accelerometer")) {
-		dev->motion = MOTION_ABS;
-		dev->motion_source = SOURCE_ACCEL;
-		dev->ifs |= XWII_IFACE_ACCEL;
-	} else if (!strcasecmp(motion, "ir")) {
-		dev->motion = MOTION_ABS;
-		dev->motion_source = SOURCE_IR;
-		dev->ifs |= XWII_IFACE_IR;
-	} else if (!strcasecmp(motion, "motionplus")) {
-		dev->motion = MOTION_REL;
-		dev->motion_source = SOURCE_MOTIONPLUS;
-		dev->ifs |= XWII_IFACE_MOTION_PLUS;
+static void xwiimote_configure_pacing(struct xwiimote_dev *dev)
+{
+	const char *t;
+
+	t = xf86FindOptionValue(dev->info->options, "MotionFrameMs");
+	parse_scale(dev, t, &dev->motion_frame_ms);
+	if (dev->motion_frame_ms < 0) dev->motion_frame_ms = 0;
+}
+
+static void xwiimote_configure_precision(struct xwiimote_dev *dev)
+{
+	const char *t;
+
+	t = xf86FindOptionValue(dev->info->options, "PrecisionGain");
+	parse_scale(dev, t, &dev->precision_gain);
+	if (dev->precision_gain < 1) dev->precision_gain = 1;
+
+	t = xf86FindOptionValue(dev->info->options, "PrecisionSmoothing");
+	parse_scale(dev, t, &dev->precision_smoothing);
+	if (dev->precision_smoothing < 1) dev->precision_smoothing = 1;
+}
+
+static int parse_wii_key(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; wii_keys[i].name; ++i) {
+		if (!strcasecmp(wii_keys[i].name, name))
+			return wii_keys[i].code;
+	}
+
+	return -1;
+}
+
+static void parse_layer(struct xwiimote_dev *dev, const char *t,
+			struct layer *out)
+{
+	int key;
+
+	if (!t)
+		return;
+
+	if (!strcasecmp(t, "none") || !strcasecmp(t, "off")) {
+		out->select = LAYER_SELECT_NONE;
+	} else if (!strcasecmp(t, "ir")) {
+		out->select = LAYER_SELECT_IR;
+	} else if (!strncasecmp(t, "hold:", 5) &&
+		   (key = parse_wii_key(&t[5])) >= 0) {
+		out->select = LAYER_SELECT_KEY;
+		out->key = key;
+	} else if (!strncasecmp(t, "extension:", 10) && t[10]) {
+		out->extension = strdup(&t[10]);
+		if (out->extension)
+			out->select = LAYER_SELECT_EXTENSION;
+	} else {
+		xf86IDrvMsg(dev->info, X_ERROR, "Invalid layer selector %s\n", t);
+	}
+}
+
+/*
+ * Precompute the layer lookup: every layer has one bit, and for each
+ * combination of selected layers the one with the highest index wins.
+ */
+static void xwiimote_configure_layer_table(struct xwiimote_dev *dev)
+{
+	unsigned int i, mask;
+	struct layer *l;
+
+	for (i = 1; i < XWIIMOTE_LAYER_NUM; ++i) {
+		l = &dev->layers[i];
+		if (l->select == LAYER_SELECT_IR)
+			dev->layer_ir_mask |= 1U << i;
+		else if (l->select == LAYER_SELECT_EXTENSION)
+			dev->layer_ext_mask |= 1U << i;
+		else if (l->select == LAYER_SELECT_KEY)
+			dev->layer_key_mask[l->key] |= 1U << i;
+	}
+
+	for (mask = 0; mask < (1U << XWIIMOTE_LAYER_NUM); ++mask) {
+		dev->layer_table[mask] = 0;
+		for (i = XWIIMOTE_LAYER_NUM - 1; i > 0; --i) {
+			if (mask & (1U << i)) {
+				dev->layer_table[mask] = i;
+				break;
+			}
+		}
+	}
+}
+
+static void xwiimote_configure_layers(struct xwiimote_dev *dev)
+{
+	const char *key;
+	char opt[64];
+	unsigned int i, j, code;
+
+	dev->layers[1].select = LAYER_SELECT_IR;
+	for (i = 1; i < XWIIMOTE_LAYER_NUM; ++i) {
+		snprintf(opt, sizeof(opt), "Layer%uSelect", i);
+		key = xf86FindOptionValue(dev->info->options, opt);
+		parse_layer(dev, key, &dev->layers[i]);
+	}
+
+	for (j = 0; wii_keys[j].name; ++j) {
+		code = wii_keys[j].code;
+
+		snprintf(opt, sizeof(opt), "Map%s", wii_keys[j].name);
+		key = xf86FindOptionValue(dev->info->options, opt);
+		parse_key(dev, key, &dev->map_key[0][code]);
+
+		/* all layers start out with the base mappings */
+		for (i = 1; i < XWIIMOTE_LAYER_NUM; ++i)
+			dev->map_key[i][code] = dev->map_key[0][code];
+
+		snprintf(opt, sizeof(opt), "MapIR%s", wii_keys[j].name);
+		key = xf86FindOptionValue(dev->info->options, opt);
+		parse_key(dev, key, &dev->map_key[1][code]);
+
+		for (i = 1; i < XWIIMOTE_LAYER_NUM; ++i) {
+			snprintf(opt, sizeof(opt), "MapLayer%u%s", i,
+				 wii_keys[j].name);
+			key = xf86FindOptionValue(dev->info->options, opt);
+			parse_key(dev, key, &dev->map_key[i][code]);
+		}
+	}
+
+	xwiimote_configure_layer_table(dev);
+}
+
+static void xwiimote_configure_actions(struct xwiimote_dev *dev)
+{
+	const char *t;
+	char opt[64], a[16], b[16];
+	unsigned int i, code;
+	int ka, kb;
+	struct key_chord *c;
+
+	t = xf86FindOptionValue(dev->info->options, "KeyResolveMs");
+	parse_scale(dev, t, &dev->key_resolve_ms);
+	if (dev->key_resolve_ms < 1) dev->key_resolve_ms = 1;
+
+	for (i = 0; wii_keys[i].name; ++i) {
+		code = wii_keys[i].code;
+
+		snprintf(opt, sizeof(opt), "Hold%s", wii_keys[i].name);
+		t = xf86FindOptionValue(dev->info->options, opt);
+		parse_key(dev, t, &dev->map_hold[code]);
+
+		snprintf(opt, sizeof(opt), "LongPress%s", wii_keys[i].name);
+		t = xf86FindOptionValue(dev->info->options, opt);
+		parse_key(dev, t, &dev->map_long[code]);
+
+		if (dev->map_hold[code].type != FUNC_IGNORE ||
+		    dev->map_long[code].type != FUNC_IGNORE)
+			dev->key_deferred[code] = true;
+	}
+
+	for (i = 0; i < XWIIMOTE_CHORD_NUM; ++i) {
+		c = &dev->chords[i];
+
+		snprintf(opt, sizeof(opt), "Chord%u", i + 1);
+		t = xf86FindOptionValue(dev->info->options, opt);
+		if (!t)
+			continue;
+
+		if (sscanf(t, "%15[^+]+%15s", a, b) != 2 ||
+		    (ka = parse_wii_key(a)) < 0 ||
+		    (kb = parse_wii_key(b)) < 0 || ka == kb) {
+			xf86IDrvMsg(dev->info, X_ERROR, "Invalid chord %s\n", t);
+			continue;
+		}
+
+		snprintf(opt, sizeof(opt), "MapChord%u", i + 1);
+		t = xf86FindOptionValue(dev->info->options, opt);
+		parse_key(dev, t, &c->func);
+
+		c->a = ka;
+		c->b = kb;
+		dev->key_deferred[ka] = true;
+		dev->key_deferred[kb] = true;
+	}
+}
+
+static bool xwiimote_uses_func(struct xwiimote_dev *dev, int type)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < XWII_KEY_NUM; ++i) {
+		for (j = 0; j < XWIIMOTE_LAYER_NUM; ++j) {
+			if (dev->map_key[j][i].type == type)
+				return true;
+		}
+		if (dev->map_hold[i].type == type ||
+		    dev->map_long[i].type == type)
+			return true;
+	}
+
+	for (i = 0; i < XWIIMOTE_CHORD_NUM; ++i) {
+		if (dev->chords[i].func.type == type)
+			return true;
+	}
+
+	for (i = 0; i < GESTURE_NUM; ++i) {
+		if (dev->map_gesture[i].type == type)
+			return true;
+	}
+
+	return false;
+}
+
+static void xwiimote_configure_scroll(struct xwiimote_dev *dev)
+{
+	const char *t;
+	bool stick_scroll = false;
+	unsigned int i;
+
+	t = xf86FindOptionValue(dev->info->options, "ScrollIncrement");
+	parse_scale(dev, t, &dev->scroll_increment);
+	if (!dev->scroll_increment) dev->scroll_increment = 1;
+
+	t = xf86FindOptionValue(dev->info->options, "ScrollDecayMs");
+	parse_scale(dev, t, &dev->scroll_decay_ms);
+	if (dev->scroll_decay_ms < 0) dev->scroll_decay_ms = 0;
+
+	for (i = 0; i < STICK_NUM; ++i) {
+		if (dev->sticks[i].mode == STICK_SCROLL)
+			stick_scroll = true;
+	}
+
+	if (!xwiimote_uses_func(dev, FUNC_SCROLL) && !stick_scroll)
+		return;
+
+#ifdef HAVE_SMOOTH_SCROLLING
+	if (dev->motion_source != SOURCE_NONE) {
+		dev->scroll_axis = dev->axes_num;
+		dev->axes_num += 2;
+	}
+#else
+	xf86IDrvMsg(dev->info, X_WARNING,
+		    "Smooth scrolling not supported by this server\n");
+#endif
+
+	if (dev->scroll_axis < 0 && stick_scroll) {
+		xf86IDrvMsg(dev->info, X_WARNING,
+			    "Stick scrolling needs a MotionSource\n");
+		for (i = 0; i < STICK_NUM; ++i) {
+			if (dev->sticks[i].mode == STICK_SCROLL)
+				dev->sticks[i].mode = STICK_OFF;
+		}
+	}
+}
+
+static enum stick_mode parse_stick(struct xwiimote_dev *dev, const char *opt,
+				   const char *def)
+{
+	const char *t;
+
+	t = xf86FindOptionValue(dev->info->options, opt);
+	if (!t)
+		t = def;
+
+	if (!strcasecmp(t, "motion"))
+		return STICK_MOTION;
+	if (!strcasecmp(t, "scroll"))
+		return STICK_SCROLL;
+	if (strcasecmp(t, "off"))
+		xf86IDrvMsg(dev->info, X_ERROR, "Invalid %s %s\n", opt, t);
+	return STICK_OFF;
+}
+
+static void xwiimote_configure_sticks(struct xwiimote_dev *dev)
+{
+	const char *t;
+	const char *def[STICK_NUM] = { "off", "off", "off", "off" };
+	double v;
+	int i;
+
+	if (dev->motion_source == SOURCE_NUNCHUK) {
+		def[STICK_NUNCHUK] = "motion";
+	} else if (dev->motion_source == SOURCE_CONTROLLER) {
+		def[STICK_LEFT] = "motion";
+		def[STICK_RIGHT] = "scroll";
+	} else if (dev->motion_source == SOURCE_BOARD) {
+		def[STICK_BOARD] = "motion";
+	}
+
+	for (i = 0; i < STICK_NUM; ++i) {
+		dev->sticks[i].mode = parse_stick(dev, stick_names[i], def[i]);
+
+		/* stick motion needs relative valuators */
+		if (dev->sticks[i].mode == STICK_MOTION &&
+		    dev->motion_source != SOURCE_NUNCHUK &&
+		    dev->motion_source != SOURCE_CONTROLLER &&
+		    dev->motion_source != SOURCE_BOARD) {
+			xf86IDrvMsg(dev->info, X_WARNING,
+				    "%s motion needs a stick MotionSource\n",
+				    stick_names[i]);
+			dev->sticks[i].mode = STICK_OFF;
+		}
+	}
+
+	t = xf86FindOptionValue(dev->info->options, "StickDeadzone");
+	parse_scale(dev, t, &dev->stick_deadzone);
+	if (dev->stick_deadzone < 0) dev->stick_deadzone = 0;
+	else if (dev->stick_deadzone >= XWIIMOTE_STICK_RES)
+		dev->stick_deadzone = XWIIMOTE_STICK_RES - 1;
+
+	t = xf86FindOptionValue(dev->info->options, "StickSpeed");
+	parse_scale(dev, t, &dev->stick_speed);
+	if (dev->stick_speed < 0) dev->stick_speed = 0;
+
+	dev->stick_curve = xf86SetRealOption(dev->info->options, "StickCurve",
+					     XWIIMOTE_STICK_CURVE);
+	if (dev->stick_curve <= 0) dev->stick_curve = 1.0;
+
+	for (i = 0; i <= XWIIMOTE_STICK_RES; ++i) {
+		if (i <= dev->stick_deadzone) {
+			v = 0;
+		} else {
+			v = (double)(i - dev->stick_deadzone) /
+			    (XWIIMOTE_STICK_RES - dev->stick_deadzone);
+			v = pow(v, dev->stick_curve);
+		}
+
+		dev->stick_lut[i] = v * dev->stick_speed;
+	}
+}
+
+static void xwiimote_configure_raw(struct xwiimote_dev *dev)
+{
+	const char *t;
+	char *list, *tok, *save;
+	unsigned int i, iface;
+
+	for (i = 0; i < RAW_NUM; ++i)
+		dev->raw_axis[i] = -1;
+
+	dev->orientation = xf86SetBoolOption(dev->info->options, "Orientation",
+					     FALSE);
+
+	t = xf86FindOptionValue(dev->info->options, "MPUnitsPerDegree");
+	parse_scale(dev, t, &dev->mp_units_per_deg);
+	if (dev->mp_units_per_deg < 1) dev->mp_units_per_deg = 1;
+
+	t = xf86FindOptionValue(dev->info->options, "RawValuators");
+	if (!t)
+		t = "off";
+
+	if (!strcasecmp(t, "on") || !strcasecmp(t, "true") ||
+	    !strcmp(t, "1") || !strcasecmp(t, "all")) {
+		dev->raw_ifs = XWII_IFACE_ACCEL | XWII_IFACE_MOTION_PLUS |
+			       XWII_IFACE_IR;
+	} else if (strcasecmp(t, "off") && strcasecmp(t, "false") &&
+		   strcmp(t, "0")) {
+		list = strdup(t);
+		if (!list)
+			return;
+		for (tok = strtok_r(list, ", ", &save); tok;
+		     tok = strtok_r(NULL, ", ", &save)) {
+			if (!strcasecmp(tok, "accelerometer") ||
+			    !strcasecmp(tok, "accel"))
+				dev->raw_ifs |= XWII_IFACE_ACCEL;
+			else if (!strcasecmp(tok, "motionplus"))
+				dev->raw_ifs |= XWII_IFACE_MOTION_PLUS;
+			else if (!strcasecmp(tok, "ir"))
+				dev->raw_ifs |= XWII_IFACE_IR;
+			else
+				xf86IDrvMsg(dev->info, X_ERROR,
+					    "Invalid RawValuators entry %s\n",
+					    tok);
+		}
+		free(list);
+	}
+
+	for (i = 0; i < RAW_NUM; ++i) {
+		if (i >= RAW_ORIENT) {
+			if (dev->orientation)
+				dev->raw_axis[i] = dev->axes_num++;
+			continue;
+		}
+
+		if (i < RAW_MOTIONPLUS)
+			iface = XWII_IFACE_ACCEL;
+		else if (i < RAW_IR)
+			iface = XWII_IFACE_MOTION_PLUS;
+		else
+			iface = XWII_IFACE_IR;
+
+		if (dev->raw_ifs & iface)
+			dev->raw_axis[i] = dev->axes_num++;
+	}
+
+	dev->raw_used = dev->raw_ifs || dev->orientation;
+}
+
+static void xwiimote_configure_gestures(struct xwiimote_dev *dev)
+{
+	const char *t;
+	char opt[64];
+	unsigned int i;
+
+	for (i = 0; i < GESTURE_NUM; ++i) {
+		snprintf(opt, sizeof(opt), "Map%s", gesture_names[i]);
+		t = xf86FindOptionValue(dev->info->options, opt);
+		parse_key(dev, t, &dev->map_gesture[i]);
+		if (dev->map_gesture[i].type != FUNC_IGNORE)
+			dev->gestures_mapped = true;
 	}
 
-	key = xf86FindOptionValue(dev->info->options, "MapLeft");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_LEFT]);
+	t = xf86FindOptionValue(dev->info->options, "GestureThreshold");
+	parse_scale(dev, t, &dev->gesture_threshold);
+	if (dev->gesture_threshold < 1) dev->gesture_threshold = 1;
+
+	t = xf86FindOptionValue(dev->info->options, "GestureCooldownMs");
+	parse_scale(dev, t, &dev->gesture_cooldown_ms);
+	if (dev->gesture_cooldown_ms < 0) dev->gesture_cooldown_ms = 0;
 
-	key = xf86FindOptionValue(dev->info->options, "MapRight");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_RIGHT]);
+	t = xf86FindOptionValue(dev->info->options, "TwistAngle");
+	parse_scale(dev, t, &dev->gesture_twist_angle);
+	if (dev->gesture_twist_angle < 1) dev->gesture_twist_angle = 1;
 
-	key = xf86FindOptionValue(dev->info->options, "MapUp");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_UP]);
+	dev->gestures = dev->gestures_mapped;
+}
 
-	key = xf86FindOptionValue(dev->info->options, "MapDown");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_DOWN]);
+static void xwiimote_configure_idle(struct xwiimote_dev *dev)
+{
+	const char *t;
 
-	key = xf86FindOptionValue(dev->info->options, "MapA");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_A]);
+	t = xf86FindOptionValue(dev->info->options, "IdleTimeoutSecs");
+	parse_scale(dev, t, &dev->idle_timeout_secs);
+	if (dev->idle_timeout_secs < 0) dev->idle_timeout_secs = 0;
 
-	key = xf86FindOptionValue(dev->info->options, "MapB");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_B]);
+	t = xf86FindOptionValue(dev->info->options, "IdleMotionThreshold");
+	parse_scale(dev, t, &dev->idle_motion_threshold);
+	if (dev->idle_motion_threshold < 1) dev->idle_motion_threshold = 1;
 
-	key = xf86FindOptionValue(dev->info->options, "MapPlus");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_PLUS]);
+	dev->idle_ifs = XWIIMOTE_IDLE_IFACES;
+	if (xf86SetBoolOption(dev->info->options, "IdleWakeOnMotion", TRUE))
+		dev->idle_ifs &= ~XWII_IFACE_ACCEL;
+}
 
-	key = xf86FindOptionValue(dev->info->options, "MapMinus");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_MINUS]);
+static void xwiimote_configure_mpx(struct xwiimote_dev *dev)
+{
+	const char *t;
 
-	key = xf86FindOptionValue(dev->info->options, "MapHome");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_HOME]);
+	dev->mpx = xf86SetBoolOption(dev->info->options, "MultiPointer", FALSE);
 
-	key = xf86FindOptionValue(dev->info->options, "MapOne");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_ONE]);
+	t = xf86FindOptionValue(dev->info->options, "MultiPointerLingerSecs");
+	parse_scale(dev, t, &dev->mpx_linger_secs);
+	if (dev->mpx_linger_secs < 0) dev->mpx_linger_secs = 0;
+}
 
-	key = xf86FindOptionValue(dev->info->options, "MapTwo");
-	parse_key(dev, key, &dev->map_key[KEYSET_NORMAL][XWII_KEY_TWO]);
+static void xwiimote_configure_record(struct xwiimote_dev *dev)
+{
+	const char *dir, *t;
+	int capacity = XWIIMOTE_REC_CAPACITY;
+	unsigned int size;
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRLeft");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_LEFT]);
+	dir = xf86FindOptionValue(dev->info->options, "RecordDir");
+	if (!dir || !dir[0])
+		return;
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRRight");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_RIGHT]);
+	t = xf86FindOptionValue(dev->info->options, "RecordSize");
+	parse_scale(dev, t, &capacity);
+	if (capacity < 1)
+		capacity = 1;
+	if (capacity > 1 << 24)
+		capacity = 1 << 24;
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRUp");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_UP]);
+	/* the ring index is masked, so round up to a power of two */
+	for (size = 1; size < (unsigned int)capacity; size <<= 1)
+		;
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRDown");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_DOWN]);
+	xwiimote_rec_open(dev, dir, size);
+	dev->rec_on = dev->rec &&
+		      xf86SetBoolOption(dev->info->options, "Record", TRUE);
+}
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRA");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_A]);
+static void xwiimote_configure_calib(struct xwiimote_dev *dev)
+{
+	char *file;
+
+	file = xf86SetStrOption(dev->info->options, "CalibrationFile",
+				XWIIMOTE_CALIBRATION_FILE);
+	if (!file || !file[0] || !strcasecmp(file, "none") ||
+	    !strcasecmp(file, "off")) {
+		free(file);
+		file = NULL;
+	}
+	dev->calib_file = file;
+}
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRB");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_B]);
+static void xwiimote_configure_direct(struct xwiimote_dev *dev)
+{
+	if (xf86SetBoolOption(dev->info->options, "DirectInput", FALSE))
+		dev->direct_ifs = XWIIMOTE_DIRECT_IFACES;
+}
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRPlus");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_PLUS]);
+static void xwiimote_configure(struct xwiimote_dev *dev)
+{
+	const char *motion;
+	unsigned int i;
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRMinus");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_MINUS]);
+	for (i = 0; i < XWIIMOTE_LAYER_NUM; ++i)
+		memcpy(dev->map_key[i], map_key_default, sizeof(map_key_default));
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRHome");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_HOME]);
+	dev->minimal_keymap = xf86SetBoolOption(dev->info->options,
+						"MinimalKeymap", FALSE);
 
-	key = xf86FindOptionValue(dev->info->options, "MapIROne");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_ONE]);
+	motion = xf86FindOptionValue(dev->info->options, "MotionSource");
+	if (!motion)
+		motion = "";
 
-	key = xf86FindOptionValue(dev->info->options, "MapIRTwo");
-	parse_key(dev, key, &dev->map_key[KEYSET_IR][XWII_KEY_TWO]);
+	if (!strcasecmp(motion, "accelerometer")) {
+		dev->motion = MOTION_ABS;
+		dev->motion_source = SOURCE_ACCEL;
+	} else if (!strcasecmp(motion, "ir")) {
+		dev->motion = MOTION_ABS;
+		dev->motion_source = SOURCE_IR;
+	} else if (!strcasecmp(motion, "motionplus")) {
+		dev->motion = MOTION_REL;
+		dev->motion_source = SOURCE_MOTIONPLUS;
+	} else if (!strcasecmp(motion, "nunchuk")) {
+		dev->motion = MOTION_REL;
+		dev->motion_source = SOURCE_NUNCHUK;
+	} else if (!strcasecmp(motion, "controller")) {
+		dev->motion = MOTION_REL;
+		dev->motion_source = SOURCE_CONTROLLER;
+	} else if (!strcasecmp(motion, "board")) {
+		dev->motion = MOTION_REL;
+		dev->motion_source = SOURCE_BOARD;
+	}
 
+	xwiimote_configure_layers(dev);
+	xwiimote_configure_actions(dev);
 	xwiimote_configure_mp(dev);
 	xwiimote_configure_ir(dev);
+	xwiimote_configure_accel(dev);
+	xwiimote_configure_click_lock(dev);
+	xwiimote_configure_pacing(dev);
+	xwiimote_configure_precision(dev);
+	xwiimote_configure_gestures(dev);
+	xwiimote_configure_sticks(dev);
+	xwiimote_configure_scroll(dev);
+	xwiimote_configure_raw(dev);
+	xwiimote_configure_idle(dev);
+	xwiimote_configure_mpx(dev);
+	xwiimote_configure_direct(dev);
+	xwiimote_configure_calib(dev);
+	xwiimote_configure_record(dev);
+	xwiimote_update_ifs(dev);
 }
 
 static int xwiimote_preinit(InputDriverPtr drv, InputInfoPtr info, int flags)
 {
 	struct xwiimote_dev *dev;
+	unsigned int i;
 	int ret;
 
-	dev = malloc(sizeof(*dev));
-	if (!dev)
+	if (posix_memalign((void**)&dev, XWIIMOTE_CACHE_LINE, sizeof(*dev)))
 		return BadAlloc;
 
 	memset(dev, 0, sizeof(*dev));
@@ -1554,10 +5560,39 @@ static int xwiimote_preinit(InputDriverPtr drv, InputInfoPtr info, int flags)
 	dev->mp_y_scale = 1;
 	dev->mp_z_scale = 1;
 	dev->ir_avg_radius = XWIIMOTE_IR_AVG_RADIUS;
-	dev->ir_avg_max_samples = XWIIMOTE_IR_AVG_MAX_SAMPLES;
-	dev->ir_avg_min_samples = XWIIMOTE_IR_AVG_MIN_SAMPLES;
+	dev->ir_avg_max_ms = XWIIMOTE_IR_AVG_MAX_MS;
+	dev->ir_avg_min_ms = XWIIMOTE_IR_AVG_MIN_MS;
 	dev->ir_avg_weight = XWIIMOTE_IR_AVG_WEIGHT;
 	dev->ir_keymap_expiry_secs = XWIIMOTE_IR_KEYMAP_EXPIRY_SECS;
+	dev->ir_rate.interval = XWIIMOTE_RATE_DEFAULT_US;
+	dev->accel_history_ms = XWIIMOTE_ACCEL_HISTORY_MS;
+	dev->accel_rate.interval = XWIIMOTE_RATE_DEFAULT_US;
+	dev->accel_tilt_range = XWIIMOTE_ACCEL_TILT_RANGE;
+	dev->accel_smooth_ms = XWIIMOTE_ACCEL_SMOOTH_MS;
+	dev->accel_deadband = XWIIMOTE_ACCEL_DEADBAND;
+	dev->accel_joy_deadzone = XWIIMOTE_ACCEL_JOY_DEADZONE;
+	dev->accel_joy_speed = XWIIMOTE_ACCEL_JOY_SPEED;
+	dev->click_lock_lookback_ms = XWIIMOTE_CLICK_LOCK_LOOKBACK_MS;
+	dev->precision_gain = XWIIMOTE_PRECISION_GAIN;
+	dev->precision_smoothing = XWIIMOTE_PRECISION_SMOOTHING;
+	dev->key_resolve_ms = XWIIMOTE_KEY_RESOLVE_MS;
+	dev->axes_num = 2;
+	dev->scroll_axis = -1;
+	dev->scroll_increment = XWIIMOTE_SCROLL_INCREMENT;
+	dev->scroll_decay_ms = XWIIMOTE_SCROLL_DECAY_MS;
+	dev->gesture_rate.interval = XWIIMOTE_RATE_DEFAULT_US;
+	dev->gesture_threshold = XWIIMOTE_GESTURE_THRESHOLD;
+	dev->gesture_cooldown_ms = XWIIMOTE_GESTURE_COOLDOWN_MS;
+	dev->gesture_twist_angle = XWIIMOTE_TWIST_ANGLE;
+	dev->idle_motion_threshold = XWIIMOTE_IDLE_MOTION_THRESHOLD;
+	dev->key_pending = -1;
+	dev->mpx_linger_secs = XWIIMOTE_MPX_LINGER_SECS;
+	dev->mp_units_per_deg = XWIIMOTE_MP_UNITS_PER_DEG;
+	dev->orient_rate.interval = XWIIMOTE_RATE_DEFAULT_US;
+	dev->stick_deadzone = XWIIMOTE_STICK_DEADZONE;
+	dev->stick_speed = XWIIMOTE_STICK_SPEED;
+	for (i = 0; i < DIRECT_NUM; ++i)
+		dev->direct[i].fd = -1;
 
 	dev->device = xf86FindOptionValue(info->options, "Device");
 	if (!dev->device) {
@@ -1572,15 +5607,14 @@ static int xwiimote_preinit(InputDriverPtr drv, InputInfoPtr info, int flags)
 	}
 
 	/* Check for duplicate */
-	if (!dev->info->name || strcmp(dev->info->name, XWII_NAME_CORE) ||
-							xwiimote_is_dev(dev)) {
+	if (!dev->info->name || xwiimote_is_dev(dev) ||
+	    !xwiimote_is_primary(dev->info->name)) {
 		xf86IDrvMsg(dev->info, X_INFO, "No core device\n");
 		dev->dup = true;
 		return Success;
 	}
 	xf86IDrvMsg(dev->info, X_INFO, "Is a core device\n");
 
-	dev->ifs = XWII_IFACE_CORE;
 	ret = xwii_iface_new(&dev->iface, dev->root);
 	if (ret) {
 		xf86IDrvMsg(info, X_ERROR, "Cannot alloc interface\n");
@@ -1590,10 +5624,13 @@ static int xwiimote_preinit(InputDriverPtr drv, InputInfoPtr info, int flags)
 
 	xwiimote_add_dev(dev);
 	xwiimote_configure(dev);
+	xwiimote_calib_load(dev);
 
 	return Success;
 
 err_free:
+	free(dev->root);
+	free(dev->uniq);
 	free(dev);
 	info->private = NULL;
 	return ret;
@@ -1602,6 +5639,7 @@ err_free:
 static void xwiimote_uninit(InputDriverPtr drv, InputInfoPtr info, int flags)
 {
 	struct xwiimote_dev *dev;
+	unsigned int i;
 
 	if (!info)
 		return;
@@ -1610,10 +5648,24 @@ static void xwiimote_uninit(InputDriverPtr drv, InputInfoPtr info, int flags)
 		dev = info->private;
 		if (!dev->dup) {
 			XkbFreeRMLVOSet(&dev->rmlvo, FALSE);
+			for (i = 0; i < XWIIMOTE_LAYER_NUM; ++i)
+				free(dev->layers[i].extension);
+			TimerFree(dev->key_timer);
+			TimerFree(dev->scroll_timer);
+			TimerFree(dev->motion_timer);
+			TimerFree(dev->stick_timer);
+			TimerFree(dev->idle_timer);
+			TimerFree(dev->open_timer);
+			xwiimote_open_cancel(dev);
+			TimerFree(dev->calib_timer);
+			free(dev->calib_file);
+			xwiimote_rec_close(dev);
+			xwiimote_mpx_release(dev);
 			xwiimote_rm_dev(dev);
 			xwii_iface_unref(dev->iface);
 		}
 		free(dev->root);
+		free(dev->uniq);
 		free(dev);
 		info->private = NULL;
 	}